@@ -0,0 +1,338 @@
+/*
+ * machine readable statistics
+ *
+ * /api/stats returns every channel's last snapshot as json, or in the
+ * binary form of stats.h with ?format=bin. /metrics is the same and
+ * the process totals for prometheus. nothing here takes a lock the
+ * ingest or egress threads wait on.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "mongoose.h"
+#include "stream.h"
+#include "stats.h"
+#include "counter.h"
+#include "rtvd.h"
+
+
+static const char *json_reply = "HTTP/1.1 200 OK\r\n"
+"Content-Type: application/json\r\n"
+"Cache-Control: no-cache\r\n"
+"Connection: close\r\n\r\n";
+
+static const char *bin_reply = "HTTP/1.1 200 OK\r\n"
+"Content-Type: application/octet-stream\r\n"
+"Cache-Control: no-cache\r\n"
+"Connection: close\r\n\r\n";
+
+static void api_stats_json(struct mg_connection *conn, struct chan_stats *cs,
+		struct client_stats *clients, int nr)
+{
+	struct pid_stats *ps;
+	struct client_stats *c;
+	struct in_addr in;
+	char addr[32];
+	uint32_t i;
+	int j;
+
+	stream_addr_str(cs->key, addr, sizeof(addr));
+	mg_out_printf(conn, "{\"udp\":\"%s\",\"epoch\":%u,\"rate_dgrams\":%u,"
+		"\"rate_bytes\":%u,\"dgrams\":%llu,\"bytes\":%llu,\"udp_drops\":%u,\"sync_resyncs\":%u,\"sync_skipped\":%u,"
+		"\"stalls\":%u,\"stall_ms\":%llu,\"null_dgrams\":%llu,"
+		"\"pid_overflow\":%u,\"pids\":[",
+		addr, cs->epoch, cs->rate_dgrams, cs->rate_bytes,
+		(unsigned long long)cs->dgrams, (unsigned long long)cs->bytes,
+		cs->udp_drops, cs->sync_resyncs, cs->sync_skipped,
+		cs->stalls, (unsigned long long)cs->stall_ms,
+		(unsigned long long)cs->null_dgrams, cs->pid_overflow);
+	for (i = 0; i < cs->nr_pids; i++) {
+		ps = &cs->pids[i];
+		mg_out_printf(conn, "%s{\"pid\":%u,\"count\":%llu,"
+			"\"cc_errors\":%u,\"rate\":%u,\"rate_10s\":%u,"
+			"\"rate_1m\":%u,\"rate_1h\":%u}",
+			i ? "," : "", ps->pid, (unsigned long long)ps->count,
+			ps->cc_errors, ps->rate, ps->rate_10s, ps->rate_1m,
+			ps->rate_1h);
+	}
+	mg_out_printf(conn, "],\"clients\":[");
+	for (j = 0; j < nr; j++) {
+		c = &clients[j];
+		in.s_addr = htonl(c->ip);
+		mg_out_printf(conn, "%s{\"addr\":\"%s:%u\",\"slot\":%u,"
+			"\"start\":%lld,\"sent\":%llu,\"discarded\":%llu}",
+			j ? "," : "", inet_ntoa(in), c->port, c->slot,
+			(long long)c->start_time,
+			(unsigned long long)c->send_bytes,
+			(unsigned long long)c->discard_bytes);
+	}
+	mg_out_printf(conn, "]}");
+}
+
+static void api_stats_bin(struct mg_connection *conn, struct chan_stats *cs,
+		struct client_stats *clients, int nr)
+{
+	mg_out_write(conn, cs, offsetof(struct chan_stats, pids));
+	mg_out_write(conn, cs->pids, cs->nr_pids * sizeof(cs->pids[0]));
+	mg_out_write(conn, clients, nr * sizeof(clients[0]));
+}
+
+void stream_api_handler(struct mg_connection *conn,
+			const struct mg_request_info *ri, void *data)
+{
+	struct client_stats *clients;
+	struct stats_bin_hdr hdr;
+	struct chan_stats *cs;
+	const char *qs = ri->query_string;
+	char format[8];
+	int i, n, bin, nr = 0;
+
+	(void)data;
+	mg_get_var_3(qs, qs ? strlen(qs) : 0, "format", format, sizeof(format));
+	bin = !strcmp(format, "bin");
+
+	cs = mg_arena_alloc(conn, sizeof(*cs));
+	clients = mg_arena_alloc(conn, stream_max_streams() * sizeof(*clients));
+	if (!cs || !clients)
+		return;
+
+	if (bin) {
+		mg_out_printf(conn, "%s", bin_reply);
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = STATS_BIN_MAGIC;
+		hdr.version = STATS_BIN_VERSION;
+		hdr.chan_size = offsetof(struct chan_stats, pids);
+		hdr.time = time(NULL);
+		mg_out_write(conn, &hdr, sizeof(hdr));
+	} else {
+		mg_out_printf(conn, "%s", json_reply);
+		mg_out_printf(conn, "{\"version\":\"%s\",\"time\":%lld,\"channels\":[",
+			RTVD_VERSION, (long long)time(NULL));
+	}
+
+	for (i = 0; i < stream_nr_slots(); i++) {
+		n = stream_get_stats(i, cs, clients);
+		if (n < 0)
+			continue;
+		if (bin) {
+			api_stats_bin(conn, cs, clients, n);
+		} else {
+			if (nr)
+				mg_out_printf(conn, ",");
+			api_stats_json(conn, cs, clients, n);
+		}
+		nr++;
+	}
+
+	if (!bin)
+		mg_out_printf(conn, "]}\n");
+}
+
+/*
+ * /metrics, prometheus text exposition.
+ * process totals come from the sharded counters, everything per
+ * channel, pid and client from the snapshots. every family is one
+ * pass over the channels, the format wants a family's lines together.
+ */
+
+static const char *metrics_reply = "HTTP/1.1 200 OK\r\n"
+"Content-Type: text/plain; version=0.0.4\r\n"
+"Cache-Control: no-cache\r\n"
+"Connection: close\r\n\r\n";
+
+static const struct {
+	enum counter_id id;
+	const char *name;
+	const char *help;
+} counter_metrics[] = {
+	{ CNT_IN_DGRAMS, "rtvd_input_datagrams_total", "Datagrams received from udp sources." },
+	{ CNT_IN_BYTES, "rtvd_input_bytes_total", "Bytes received from udp sources." },
+	{ CNT_UDP_DROPS, "rtvd_udp_drops_total", "Datagrams the kernel dropped on full udp sockets." },
+	{ CNT_CC_ERRORS, "rtvd_cc_errors_total", "Continuity counter errors." },
+	{ CNT_STALLS, "rtvd_stalls_total", "Input stalls." },
+	{ CNT_NULL_DGRAMS, "rtvd_null_datagrams_total", "Null datagrams stuffed during stalls." },
+	{ CNT_OUT_BYTES, "rtvd_output_bytes_total", "Bytes sent to http clients." },
+	{ CNT_DISCARD_BYTES, "rtvd_discarded_bytes_total", "Bytes http clients were too slow for." },
+	{ CNT_HTTP_STREAMS, "rtvd_http_streams_total", "Http stream clients accepted." },
+	{ CNT_LOG_DROPS, "rtvd_log_drops_total", "Log messages dropped on full log rings." },
+};
+
+static uint64_t chan_bps(const struct chan_stats *cs)
+{
+	return (uint64_t)cs->rate_bytes * 8;
+}
+
+static uint64_t chan_dgrams(const struct chan_stats *cs)
+{
+	return cs->dgrams;
+}
+
+static uint64_t chan_bytes(const struct chan_stats *cs)
+{
+	return cs->bytes;
+}
+
+static uint64_t chan_udp_drops(const struct chan_stats *cs)
+{
+	return cs->udp_drops;
+}
+
+static uint64_t chan_stalls(const struct chan_stats *cs)
+{
+	return cs->stalls;
+}
+
+static uint64_t chan_stall_ms(const struct chan_stats *cs)
+{
+	return cs->stall_ms;
+}
+
+static uint64_t chan_null_dgrams(const struct chan_stats *cs)
+{
+	return cs->null_dgrams;
+}
+
+static uint64_t chan_clients(const struct chan_stats *cs)
+{
+	return cs->nr_clients;
+}
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	uint64_t (*get)(const struct chan_stats *cs);
+	int ms;			/* value in ms, shown in seconds */
+} chan_metrics[] = {
+	{ "rtvd_channel_input_bits_per_second", "gauge", "Input bitrate over the last full second.", chan_bps, 0 },
+	{ "rtvd_channel_input_datagrams_total", "counter", "Datagrams received.", chan_dgrams, 0 },
+	{ "rtvd_channel_input_bytes_total", "counter", "Bytes received.", chan_bytes, 0 },
+	{ "rtvd_channel_udp_drops_total", "counter", "Datagrams the kernel dropped on the full socket.", chan_udp_drops, 0 },
+	{ "rtvd_channel_stalls_total", "counter", "Input stalls.", chan_stalls, 0 },
+	{ "rtvd_channel_stall_seconds_total", "counter", "Time spent stalled.", chan_stall_ms, 1 },
+	{ "rtvd_channel_null_datagrams_total", "counter", "Null datagrams stuffed during stalls.", chan_null_dgrams, 0 },
+	{ "rtvd_channel_clients", "gauge", "Http stream clients.", chan_clients, 0 },
+};
+
+static void metric_head(struct mg_connection *conn, const char *name,
+		const char *type, const char *help)
+{
+	mg_out_printf(conn, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void stream_metrics_handler(struct mg_connection *conn,
+			const struct mg_request_info *ri, void *data)
+{
+	struct client_stats *clients, *c;
+	struct mg_accept_stats as;
+	struct chan_stats *cs;
+	struct in_addr in;
+	char addr[32];
+	uint64_t v;
+	size_t m;
+	int i, j, n;
+
+	(void)ri;
+	(void)data;
+	cs = mg_arena_alloc(conn, sizeof(*cs));
+	clients = mg_arena_alloc(conn, stream_max_streams() * sizeof(*clients));
+	if (!cs || !clients)
+		return;
+
+	mg_out_printf(conn, "%s", metrics_reply);
+
+	for (m = 0; m < sizeof(counter_metrics) / sizeof(counter_metrics[0]); m++) {
+		metric_head(conn, counter_metrics[m].name, "counter",
+			counter_metrics[m].help);
+		mg_out_printf(conn, "%s %llu\n", counter_metrics[m].name,
+			(unsigned long long)counter_sum(counter_metrics[m].id));
+	}
+
+	mg_get_accept_stats(conn, &as);
+	metric_head(conn, "rtvd_http_workers", "gauge", "Http worker threads.");
+	mg_out_printf(conn, "rtvd_http_workers %u\n", as.num_workers);
+	metric_head(conn, "rtvd_http_workers_busy", "gauge",
+		"Http worker threads serving a connection.");
+	mg_out_printf(conn, "rtvd_http_workers_busy %u\n", as.busy_workers);
+	metric_head(conn, "rtvd_accept_queue_depth", "gauge",
+		"Accepted connections waiting for a worker.");
+	mg_out_printf(conn, "rtvd_accept_queue_depth %u\n", as.queue_depth);
+	metric_head(conn, "rtvd_accept_queue_full_total", "counter",
+		"Times a listener found the accept queue full.");
+	mg_out_printf(conn, "rtvd_accept_queue_full_total %llu\n", as.full_waits);
+
+	for (m = 0; m < sizeof(chan_metrics) / sizeof(chan_metrics[0]); m++) {
+		metric_head(conn, chan_metrics[m].name, chan_metrics[m].type,
+			chan_metrics[m].help);
+		for (i = 0; i < stream_nr_slots(); i++) {
+			if (stream_get_stats(i, cs, NULL) < 0)
+				continue;
+			stream_addr_str(cs->key, addr, sizeof(addr));
+			v = chan_metrics[m].get(cs);
+			if (chan_metrics[m].ms)
+				mg_out_printf(conn, "%s{udp=\"%s\"} %llu.%03u\n",
+					chan_metrics[m].name, addr,
+					(unsigned long long)(v / 1000),
+					(unsigned int)(v % 1000));
+			else
+				mg_out_printf(conn, "%s{udp=\"%s\"} %llu\n",
+					chan_metrics[m].name, addr,
+					(unsigned long long)v);
+		}
+	}
+
+	metric_head(conn, "rtvd_pid_packets_total", "counter", "Packets per pid.");
+	for (i = 0; i < stream_nr_slots(); i++) {
+		if (stream_get_stats(i, cs, NULL) < 0)
+			continue;
+		stream_addr_str(cs->key, addr, sizeof(addr));
+		for (j = 0; j < (int)cs->nr_pids; j++)
+			mg_out_printf(conn, "rtvd_pid_packets_total{udp=\"%s\",pid=\"%u\"} %llu\n",
+				addr, cs->pids[j].pid,
+				(unsigned long long)cs->pids[j].count);
+	}
+	metric_head(conn, "rtvd_pid_cc_errors_total", "counter",
+		"Continuity counter errors per pid.");
+	for (i = 0; i < stream_nr_slots(); i++) {
+		if (stream_get_stats(i, cs, NULL) < 0)
+			continue;
+		stream_addr_str(cs->key, addr, sizeof(addr));
+		for (j = 0; j < (int)cs->nr_pids; j++)
+			mg_out_printf(conn, "rtvd_pid_cc_errors_total{udp=\"%s\",pid=\"%u\"} %u\n",
+				addr, cs->pids[j].pid, cs->pids[j].cc_errors);
+	}
+
+	metric_head(conn, "rtvd_client_sent_bytes_total", "counter",
+		"Bytes sent per http client.");
+	for (i = 0; i < stream_nr_slots(); i++) {
+		if ((n = stream_get_stats(i, cs, clients)) <= 0)
+			continue;
+		stream_addr_str(cs->key, addr, sizeof(addr));
+		for (j = 0; j < n; j++) {
+			c = &clients[j];
+			in.s_addr = htonl(c->ip);
+			mg_out_printf(conn, "rtvd_client_sent_bytes_total{udp=\"%s\",client=\"%s:%u\"} %llu\n",
+				addr, inet_ntoa(in), c->port,
+				(unsigned long long)c->send_bytes);
+		}
+	}
+	metric_head(conn, "rtvd_client_discarded_bytes_total", "counter",
+		"Bytes an http client was too slow for.");
+	for (i = 0; i < stream_nr_slots(); i++) {
+		if ((n = stream_get_stats(i, cs, clients)) <= 0)
+			continue;
+		stream_addr_str(cs->key, addr, sizeof(addr));
+		for (j = 0; j < n; j++) {
+			c = &clients[j];
+			in.s_addr = htonl(c->ip);
+			mg_out_printf(conn, "rtvd_client_discarded_bytes_total{udp=\"%s\",client=\"%s:%u\"} %llu\n",
+				addr, inet_ntoa(in), c->port,
+				(unsigned long long)c->discard_bytes);
+		}
+	}
+}
@@ -0,0 +1,113 @@
+/*
+ * uri routing, compiled table against the linear strcmp walk it
+ * replaced, over a mix of exact hits, prefix hits and misses.
+ *
+ * usage: route_bench [rounds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "route.h"
+
+
+#define BENCH_SYNTHETIC		48
+
+static const char *uris[] = {
+	"/test", "/stati", "/s", "/si", "/ss", "/pcr",
+	"/ajax/start_flow", "/ajax/stop_flow",
+	"/api/stats", "/api/stats.bin", "/metrics",
+	"/hls/*", "/admin/*", "/api/v1/*",
+	NULL,
+};
+
+static const char *lookups[] = {
+	"/s", "/s", "/s", "/si", "/ss", "/ajax/stop_flow", "/metrics",
+	"/hls/239.1.1.1:1234/index.m3u8", "/hls/239.1.1.1:1234/seg42.ts",
+	"/admin/reload", "/api/v1/channels/7",
+	"/index.html", "/js/jquery.js", "/favicon.ico",
+	"/x/47", "/x/3",
+	NULL,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * what default_callback() did before: first exact strcmp match
+ */
+static void *linear_match(const struct route_table *t, const char *uri)
+{
+	int i;
+
+	for (i = 0; i < t->nr; i++) {
+		if (!strcmp(uri, t->routes[i].uri))
+			return t->routes[i].data;
+	}
+
+	return NULL;
+}
+
+static double run(const struct route_table *t, int rounds,
+		void *(*match)(const struct route_table *, const char *),
+		int *hits)
+{
+	double t0 = now();
+	int r, i;
+
+	*hits = 0;
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; lookups[i]; i++)
+			*hits += match(t, lookups[i]) != NULL;
+	}
+
+	return now() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct route_table t;
+	static char synthetic[BENCH_SYNTHETIC][16];
+	int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+	int i, nr_lookups, hits;
+	double dt;
+
+	/* the synthetic routes go first, the worst case for a linear walk */
+	for (i = 0; i < BENCH_SYNTHETIC; i++) {
+		snprintf(synthetic[i], sizeof(synthetic[i]), "/x/%d", i);
+		route_add(&t, synthetic[i], synthetic[i]);
+	}
+	for (i = 0; uris[i]; i++)
+		route_add(&t, uris[i], (void *)uris[i]);
+	for (nr_lookups = 0; lookups[nr_lookups]; nr_lookups++)
+		;
+
+	printf("%d routes, %d uris x %d rounds\n", t.nr, nr_lookups, rounds);
+
+	dt = run(&t, rounds, linear_match, &hits);
+	printf("linear     %6.2f ns/lookup, %d hits (no prefix routes)\n",
+		dt * 1e9 / ((double)rounds * nr_lookups), hits / rounds);
+
+	dt = run(&t, rounds, route_match, &hits);
+	printf("uncompiled %6.2f ns/lookup, %d hits\n",
+		dt * 1e9 / ((double)rounds * nr_lookups), hits / rounds);
+
+	if (route_compile(&t)) {
+		printf("compile failed\n");
+		return 1;
+	}
+	printf("compiled   exact %u slots, prefix %u slots\n",
+		t.exact.mask + 1, t.prefix.mask + 1);
+	dt = run(&t, rounds, route_match, &hits);
+	printf("compiled   %6.2f ns/lookup, %d hits\n",
+		dt * 1e9 / ((double)rounds * nr_lookups), hits / rounds);
+
+	return 0;
+}
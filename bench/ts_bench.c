@@ -0,0 +1,129 @@
+/*
+ * ts_scan throughput, every kernel the cpu supports,
+ * on aligned datagrams and on a misaligned buffer that needs resyncs.
+ *
+ * usage: ts_bench [rounds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ts.h"
+
+
+#define BENCH_PKTS		(7 * 128)	/* stays in l2, like a freshly received batch */
+#define BENCH_HDR_MAX		(BENCH_PKTS + 8)
+
+static const char *impls[] = { "scalar", "sse2", "avx2", NULL };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(unsigned char *buf, int nr_pkt)
+{
+	int i;
+
+	for (i = 0; i < nr_pkt; i++) {
+		unsigned char *p = buf + i * TS_PKT_SIZE;
+		int pid = (i * 37) & 0x1FFF;
+
+		memset(p, 0xA5, TS_PKT_SIZE);
+		p[0] = TS_SYNC_BYTE;
+		p[1] = (i & 1 ? 0x40 : 0) | pid >> 8;
+		p[2] = pid & 0xFF;
+		p[3] = 0x10 | (i & 0x0F);
+	}
+}
+
+/*
+ * time @rounds scans of @buf, datagram by datagram like ingest does
+ */
+static double run(const unsigned char *buf, int len, int step, int rounds,
+		struct ts_hdr *hdr, int *nr_hdr, struct ts_scan_stats *st)
+{
+	double t0;
+	int r, off, n = 0;
+
+	t0 = now();
+	for (r = 0; r < rounds; r++) {
+		n = 0;
+		memset(st, 0, sizeof(*st));
+		for (off = 0; off < len; off += step)
+			n += ts_scan(buf + off, len - off < step ? len - off : step,
+				hdr + n, BENCH_HDR_MAX - n, st);
+	}
+	*nr_hdr = n;
+
+	return now() - t0;
+}
+
+/*
+ * the first kernel run is the reference for the others
+ */
+static const char *check(struct ts_hdr *ref, int *nr_ref,
+		const struct ts_hdr *hdr, int n)
+{
+	if (*nr_ref < 0) {
+		*nr_ref = n;
+		memcpy(ref, hdr, n * sizeof(*hdr));
+	}
+	if (n != *nr_ref || memcmp(hdr, ref, n * sizeof(*hdr)))
+		return "MISMATCH";
+	return "";
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+	int len = BENCH_PKTS * TS_PKT_SIZE;
+	unsigned char *buf = malloc(len + 64);
+	unsigned char *mis = malloc(len + 64);
+	struct ts_hdr *hdr = malloc(BENCH_HDR_MAX * sizeof(*hdr));
+	struct ts_hdr *ref = malloc(BENCH_HDR_MAX * sizeof(*ref));
+	struct ts_hdr *mis_ref = malloc(BENCH_HDR_MAX * sizeof(*mis_ref));
+	struct ts_scan_stats st;
+	int i, n, nr_ref = -1, nr_mis_ref = -1;
+	double t;
+
+	fill(buf, BENCH_PKTS);
+	/* 5 bytes of junk ahead and a torn packet every 32 */
+	memcpy(mis + 5, buf, len);
+	memset(mis, 0x00, 5);
+	for (i = 32; i < BENCH_PKTS; i += 32)
+		mis[5 + i * TS_PKT_SIZE] = 0x00;
+
+	printf("%d packets x %d rounds, best kernel %s\n",
+		BENCH_PKTS, rounds, ts_impl_name());
+	for (i = 0; impls[i]; i++) {
+		if (ts_set_impl(impls[i])) {
+			printf("%-8s not supported\n", impls[i]);
+			continue;
+		}
+
+		/* warm up caches and the branch predictor */
+		run(buf, len, 7 * TS_PKT_SIZE, 1, hdr, &n, &st);
+		t = run(buf, len, 7 * TS_PKT_SIZE, rounds, hdr, &n, &st);
+		printf("%-8s aligned    %6.2f ns/pkt %s\n", impls[i],
+			t * 1e9 / ((double)rounds * BENCH_PKTS),
+			check(ref, &nr_ref, hdr, n));
+
+		t = run(mis, len + 5, len + 5, rounds, hdr, &n, &st);
+		printf("%-8s misaligned %6.2f ns/pkt, %d pkts, %d resyncs, %d skipped %s\n",
+			impls[i], t * 1e9 / ((double)rounds * BENCH_PKTS),
+			n, st.resyncs, st.skipped, check(mis_ref, &nr_mis_ref, hdr, n));
+	}
+
+	free(buf);
+	free(mis);
+	free(hdr);
+	free(ref);
+	free(mis_ref);
+	return 0;
+}
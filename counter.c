@@ -0,0 +1,32 @@
+/*
+ * sharded event counters
+ */
+
+#include "counter.h"
+
+
+static struct counter_shard shards[COUNTER_SHARDS];
+static unsigned int next_shard;
+
+__thread struct counter_shard *counter_local;
+
+struct counter_shard *counter_shard_init(void)
+{
+	unsigned int i;
+
+	i = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+	counter_local = &shards[i % COUNTER_SHARDS];
+
+	return counter_local;
+}
+
+uint64_t counter_sum(enum counter_id id)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < COUNTER_SHARDS; i++)
+		sum += __atomic_load_n(&shards[i].v[id], __ATOMIC_RELAXED);
+
+	return sum;
+}
@@ -0,0 +1,52 @@
+#ifndef _COUNTER_H_
+#define _COUNTER_H_
+
+#include <stdint.h>
+
+
+/*
+ * process wide event counters, sharded per thread.
+ *
+ * a thread adds to its own cache line, handed out round robin on its
+ * first add, so ingest reactors and egress workers never write a line
+ * another one writes as long as there are no more than COUNTER_SHARDS
+ * of them. readers sum all shards, only /metrics does that.
+ */
+
+enum counter_id {
+	CNT_IN_DGRAMS,
+	CNT_IN_BYTES,
+	CNT_UDP_DROPS,
+	CNT_CC_ERRORS,
+	CNT_STALLS,
+	CNT_NULL_DGRAMS,
+	CNT_OUT_BYTES,
+	CNT_DISCARD_BYTES,
+	CNT_HTTP_STREAMS,
+	CNT_LOG_DROPS,
+	NR_COUNTERS
+};
+
+#define COUNTER_SHARDS		64
+
+struct counter_shard {
+	uint64_t v[NR_COUNTERS];
+} __attribute__((aligned(64)));
+
+extern __thread struct counter_shard *counter_local;
+
+struct counter_shard *counter_shard_init(void);
+uint64_t counter_sum(enum counter_id id);
+
+static inline void counter_add(enum counter_id id, uint64_t n)
+{
+	struct counter_shard *s = counter_local;
+
+	if (!s)
+		s = counter_shard_init();
+	/* only contended once threads outnumber the shards */
+	__atomic_fetch_add(&s->v[id], n, __ATOMIC_RELAXED);
+}
+
+
+#endif /* _COUNTER_H_ */
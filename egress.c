@@ -0,0 +1,439 @@
+/*
+ * egress workers
+ *
+ * every udp program is drained by one egress worker. the worker sends
+ * each http stream its data straight from the program's ring, at the
+ * stream's own cursor, so the ingest reactor never waits on a client
+ * and a slow client only falls behind by itself.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "egress.h"
+#include "message.h"
+#include "counter.h"
+
+
+static msgobj mo = {
+	MSG_INFO,
+	1,
+	"egress",
+};
+
+/* datagrams handed to one writev() */
+#define EGRESS_BATCH		32
+#define EGRESS_MAX_EVENTS	64
+
+struct egress_worker {
+	pthread_t thread;
+	int epfd;
+	int evfd;
+	int kicked;
+
+	pthread_mutex_t mutex;
+	struct udp_program_entry *channels;
+	int nr_channels;
+};
+
+static struct egress_worker workers[EGRESS_MAX_WORKER];
+static int nr_workers;
+
+static void egress_close_stream(struct udp_program_entry *p,
+		struct http_stream *s)
+{
+	char tbuf[32];
+
+	p->client_dirty = 1;
+	trace_info("http stream %s closed!", p->udp_addr);
+	if (s->pending) {
+		pktbuf_put(s->pending);
+		s->pending = NULL;
+	}
+	remove_http_stream(p, s);
+	if (p->nr_streams <= 0) {
+		p->idle_start_time = time(NULL);
+		trace_info("%s: idle start time %.24s",
+			p->udp_addr, ctime_r(&p->idle_start_time, tbuf));
+	}
+}
+
+/*
+ * non-blocking gather write to a client socket.
+ * return bytes sent, short if the socket filled up or failed.
+ */
+static int egress_writev(int sock, struct iovec *iov, int n)
+{
+	int sent = 0, rc;
+
+	while (n > 0) {
+		rc = writev(sock, iov, n);
+		if (rc <= 0)
+			break;
+		sent += rc;
+		while (n > 0 && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+
+	return sent;
+}
+
+/*
+ * send @s what it has not seen yet, until its socket fills up.
+ *
+ * a datagram the socket took only part of stays pending with the byte
+ * offset to resume from, so the client never sees a cut packet. once
+ * the socket is full the stream waits for EPOLLOUT. a stream that falls
+ * more than a ring behind loses whole datagrams, never part of one.
+ */
+static void egress_drain_stream(struct udp_program_entry *p,
+		struct http_stream *s)
+{
+	struct pktbuf *bufs[EGRESS_BATCH];
+	struct iovec iov[EGRESS_BATCH];
+	int off[EGRESS_BATCH], len[EGRESS_BATCH];
+	uint64_t seq[EGRESS_BATCH];	/* ring sequence of bufs[first..] */
+	uint64_t head, lost;
+	int i, n, first, rc, err;
+
+	while (!s->blocked) {
+		n = 0;
+		if (s->pending) {
+			bufs[0] = s->pending;
+			off[0] = s->pending_off;
+			len[0] = s->pending->len - s->pending_off;
+			s->pending = NULL;
+			n = 1;
+		}
+		first = n;
+
+		head = ts_ring_head(&p->ring);
+		if (head - s->cursor > TS_RING_SLOTS) {
+			lost = (head - TS_RING_SLOTS - s->cursor) * UDP_PKG_SIZE;
+			s->discard_bytes += lost;
+			counter_add(CNT_DISCARD_BYTES, lost);
+			s->cursor = head - TS_RING_SLOTS;
+		}
+		while (n < EGRESS_BATCH && s->cursor < head) {
+			bufs[n] = ts_ring_get(&p->ring, s->cursor);
+			if (!bufs[n]) {
+				/* overwritten under us */
+				s->discard_bytes += UDP_PKG_SIZE;
+				counter_add(CNT_DISCARD_BYTES, UDP_PKG_SIZE);
+				s->cursor++;
+				continue;
+			}
+			off[n] = 0;
+			len[n] = bufs[n]->len;
+			seq[n] = s->cursor;
+			s->cursor++;
+			n++;
+		}
+		if (n == 0)
+			return;
+
+		/* send straight from the shared buffers */
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = bufs[i]->data + off[i];
+			iov[i].iov_len = len[i];
+		}
+		rc = egress_writev(s->sock, iov, n);
+		err = errno;
+		if (rc > 0) {
+			s->send_bytes += rc;
+			counter_add(CNT_OUT_BYTES, rc);
+		}
+		p->client_dirty = 1;
+
+		/* release what went out, keep the datagram it stopped in */
+		for (i = 0; i < n && rc >= len[i]; i++) {
+			rc -= len[i];
+			pktbuf_put(bufs[i]);
+		}
+		if (i == n)
+			continue;
+
+		if (rc == 0 && err != EAGAIN && err != EWOULDBLOCK) {
+			for (; i < n; i++)
+				pktbuf_put(bufs[i]);
+			egress_close_stream(p, s);
+			return;
+		}
+
+		s->pending = bufs[i];
+		s->pending_off = off[i] + rc;
+		/*
+		 * not taken at all, leave them to the ring and the cursor.
+		 * slots skipped as overwritten may sit between them, so
+		 * go back to the first one's sequence, not one per buf.
+		 */
+		if (++i < n && i >= first)
+			s->cursor = seq[i];
+		for (; i < n; i++)
+			pktbuf_put(bufs[i]);
+		s->blocked = 1;
+	}
+}
+
+static void egress_drain_channel(struct udp_program_entry *p)
+{
+	struct http_stream *s;
+	int i = 0;
+
+	while (i < __atomic_load_n(&p->nr_streams, __ATOMIC_ACQUIRE)) {
+		s = p->active[i];
+		egress_drain_stream(p, s);
+		/* a closed stream leaves the last one in its place */
+		if (p->active[i] == s)
+			i++;
+	}
+}
+
+/*
+ * copy @p's client counters into its snapshot once they changed,
+ * at most every STATS_SNAP_MS. return non-zero while changes wait.
+ */
+static int egress_publish_stats(struct udp_program_entry *p, long long now)
+{
+	struct client_stats *c;
+	struct http_stream *s;
+	int i, n = 0;
+
+	if (!p->client_dirty)
+		return 0;
+	if (now - p->client_stats_ms < STATS_SNAP_MS)
+		return 1;
+	p->client_dirty = 0;
+	p->client_stats_ms = now;
+
+	/* the mutex keeps slots from being taken meanwhile */
+	pthread_mutex_lock(&p->mutex);
+	seq_write_begin(&p->client_seq);
+	for (i = 0; i < p->nr_streams; i++) {
+		s = p->active[i];
+		c = &p->client_stats[n++];
+		c->ip = s->remote_ip;
+		c->port = s->remote_port;
+		c->slot = s - p->streams;
+		c->start_time = s->start_time;
+		c->send_bytes = s->send_bytes;
+		c->discard_bytes = s->discard_bytes;
+	}
+	p->nr_client_stats = n;
+	seq_write_end(&p->client_seq);
+	pthread_mutex_unlock(&p->mutex);
+
+	return 0;
+}
+
+static void egress_stream_event(struct http_stream *s, uint32_t events)
+{
+	struct udp_program_entry *p = s->prog;
+
+	p->client_dirty = 1;
+	if (s->status != HTTP_STREAM_STATUS_RUNNING)
+		return;
+	if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+		egress_close_stream(p, s);
+		return;
+	}
+	if (events & EPOLLOUT) {
+		s->blocked = 0;
+		egress_drain_stream(p, s);
+	}
+}
+
+static void * egress_worker_thread(void *data)
+{
+	struct egress_worker *w = (struct egress_worker *)data;
+	struct epoll_event events[EGRESS_MAX_EVENTS];
+	struct udp_program_entry *p;
+	int i, n, kicked, timeout = -1;
+	long long now;
+	uint64_t v;
+
+	while (1) {
+		n = epoll_wait(w->epfd, events, EGRESS_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno != EINTR) {
+				trace_err("epoll_wait: %s", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+
+		kicked = 0;
+		pthread_mutex_lock(&w->mutex);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				kicked = 1;
+				continue;
+			}
+			egress_stream_event(
+				(struct http_stream *)events[i].data.ptr,
+				events[i].events);
+		}
+		if (kicked) {
+			if (read(w->evfd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+				trace_err("eventfd read: %s", strerror(errno));
+			/* kicks from now on wake us up again */
+			__atomic_exchange_n(&w->kicked, 0, __ATOMIC_SEQ_CST);
+			for (p = w->channels; p; p = p->egress_next)
+				egress_drain_channel(p);
+		}
+
+		/* come back for snapshots that are not due yet */
+		timeout = -1;
+		now = ingest_now_ms();
+		for (p = w->channels; p; p = p->egress_next) {
+			if (egress_publish_stats(p, now))
+				timeout = STATS_SNAP_MS;
+		}
+		pthread_mutex_unlock(&w->mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * start @nr egress workers, 0 means one per online cpu
+ */
+int egress_init(int nr)
+{
+	struct epoll_event ev;
+	int i, rc;
+
+	if (nr <= 0)
+		nr = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr <= 0)
+		nr = 1;
+	if (nr > EGRESS_MAX_WORKER)
+		nr = EGRESS_MAX_WORKER;
+
+	for (i = 0; i < nr; i++) {
+		struct egress_worker *w = &workers[i];
+
+		w->epfd = epoll_create(EGRESS_MAX_EVENTS);
+		if (w->epfd < 0) {
+			trace_err("epoll_create: %s", strerror(errno));
+			return -1;
+		}
+		w->evfd = eventfd(0, EFD_NONBLOCK);
+		if (w->evfd < 0) {
+			trace_err("eventfd: %s", strerror(errno));
+			close(w->epfd);
+			return -1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev);
+		pthread_mutex_init(&w->mutex, NULL);
+		rc = pthread_create(&w->thread, NULL, egress_worker_thread, w);
+		if (rc) {
+			trace_err("pthread_create: %s", strerror(rc));
+			close(w->evfd);
+			close(w->epfd);
+			return -1;
+		}
+		pthread_detach(w->thread);
+		nr_workers++;
+	}
+	trace_info("%d egress workers started", nr_workers);
+
+	return 0;
+}
+
+/*
+ * assign @p to the least loaded egress worker
+ */
+int egress_add_channel(struct udp_program_entry *p)
+{
+	struct egress_worker *w;
+	int i, best = 0;
+
+	if (nr_workers <= 0)
+		return -1;
+
+	for (i = 1; i < nr_workers; i++) {
+		if (workers[i].nr_channels < workers[best].nr_channels)
+			best = i;
+	}
+	w = &workers[best];
+	p->egress = best;
+
+	pthread_mutex_lock(&w->mutex);
+	p->egress_next = w->channels;
+	w->channels = p;
+	w->nr_channels++;
+	pthread_mutex_unlock(&w->mutex);
+
+	return 0;
+}
+
+/*
+ * once this returns the worker no longer looks at @p
+ */
+void egress_del_channel(struct udp_program_entry *p)
+{
+	struct egress_worker *w = &workers[p->egress];
+	struct udp_program_entry **pp;
+
+	pthread_mutex_lock(&w->mutex);
+	for (pp = &w->channels; *pp; pp = &(*pp)->egress_next) {
+		if (*pp == p) {
+			*pp = p->egress_next;
+			w->nr_channels--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/*
+ * watch @s's socket for room to write (edge triggered) and hangups.
+ * closing the socket takes it out of the epoll set again.
+ */
+int egress_add_stream(struct udp_program_entry *p, struct http_stream *s)
+{
+	struct egress_worker *w = &workers[p->egress];
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = s;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->sock, &ev) < 0) {
+		trace_err("epoll_ctl: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * new data in @p's ring, wake its worker unless already pending
+ */
+void egress_kick(struct udp_program_entry *p)
+{
+	struct egress_worker *w = &workers[p->egress];
+	uint64_t v = 1;
+
+	if (__atomic_exchange_n(&w->kicked, 1, __ATOMIC_SEQ_CST))
+		return;
+	if (write(w->evfd, &v, sizeof(v)) < 0)
+		trace_warn("eventfd write: %s", strerror(errno));
+}
@@ -0,0 +1,17 @@
+#ifndef _EGRESS_H_
+#define _EGRESS_H_
+
+#include "stream.h"
+
+
+#define EGRESS_MAX_WORKER	64
+
+int egress_init(int nr_workers);
+int egress_add_channel(struct udp_program_entry *p);
+void egress_del_channel(struct udp_program_entry *p);
+int egress_add_stream(struct udp_program_entry *p, struct http_stream *s);
+void egress_kick(struct udp_program_entry *p);
+
+
+#endif /* _EGRESS_H_ */
+
@@ -0,0 +1,194 @@
+/*
+ * ingest reactors
+ *
+ * a small fixed pool of threads multiplexing every udp program socket
+ * through epoll, instead of one blocking thread per udp program.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "ingest.h"
+#include "message.h"
+
+
+static msgobj mo = {
+	MSG_INFO,
+	1,
+	"ingest",
+};
+
+#define INGEST_MAX_EVENTS	64
+
+struct ingest_reactor {
+	int epfd;
+	pthread_t thread;
+
+	pthread_mutex_t mutex;
+	struct ingest_source *sources;
+	int nr_sources;
+};
+
+static struct ingest_reactor reactors[INGEST_MAX_REACTOR];
+static int nr_reactors;
+static int tick_ms = INGEST_TICK_MS;
+
+/*
+ * monotonic clock in ms, what ticks are measured against
+ */
+long long ingest_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void ingest_reactor_tick(struct ingest_reactor *r)
+{
+	struct ingest_source *src, *next, **pp;
+
+	pthread_mutex_lock(&r->mutex);
+	pp = &r->sources;
+	for (src = r->sources; src; src = next) {
+		next = src->next;
+		if (src->on_tick(src)) {
+			/* src is gone, only unlink it */
+			*pp = next;
+			r->nr_sources--;
+		} else {
+			pp = &src->next;
+		}
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void * ingest_reactor_thread(void *data)
+{
+	struct ingest_reactor *r = (struct ingest_reactor *)data;
+	struct epoll_event events[INGEST_MAX_EVENTS];
+	struct ingest_source *src;
+	long long last_tick, now;
+	int i, n;
+
+	last_tick = ingest_now_ms();
+	while (1) {
+		n = epoll_wait(r->epfd, events, INGEST_MAX_EVENTS, tick_ms);
+		if (n < 0 && errno != EINTR) {
+			trace_err("epoll_wait: %s", strerror(errno));
+			sleep(1);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			src = (struct ingest_source *)events[i].data.ptr;
+			src->on_input(src);
+		}
+
+		now = ingest_now_ms();
+		if (now - last_tick >= tick_ms) {
+			last_tick = now;
+			ingest_reactor_tick(r);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * start @nr reactor threads, 0 means one per online cpu
+ */
+int ingest_init(int nr)
+{
+	int i, rc;
+
+	if (nr <= 0)
+		nr = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr <= 0)
+		nr = 1;
+	if (nr > INGEST_MAX_REACTOR)
+		nr = INGEST_MAX_REACTOR;
+
+	for (i = 0; i < nr; i++) {
+		struct ingest_reactor *r = &reactors[i];
+
+		r->epfd = epoll_create(INGEST_MAX_EVENTS);
+		if (r->epfd < 0) {
+			trace_err("epoll_create: %s", strerror(errno));
+			return -1;
+		}
+		pthread_mutex_init(&r->mutex, NULL);
+		rc = pthread_create(&r->thread, NULL, ingest_reactor_thread, r);
+		if (rc) {
+			trace_err("pthread_create: %s", strerror(rc));
+			close(r->epfd);
+			return -1;
+		}
+		pthread_detach(r->thread);
+		nr_reactors++;
+	}
+	trace_info("%d ingest reactors started", nr_reactors);
+
+	return 0;
+}
+
+int ingest_nr_reactors(void)
+{
+	return nr_reactors;
+}
+
+/*
+ * tick every @ms (at most INGEST_TICK_MS), call before ingest_init()
+ */
+void ingest_set_tick(int ms)
+{
+	if (ms < 1)
+		ms = 1;
+	if (ms > INGEST_TICK_MS)
+		ms = INGEST_TICK_MS;
+	tick_ms = ms;
+}
+
+/*
+ * assign @src to the least loaded reactor and start polling it
+ */
+int ingest_add(struct ingest_source *src)
+{
+	struct ingest_reactor *r;
+	struct epoll_event ev;
+	int i, best = 0;
+
+	if (nr_reactors <= 0)
+		return -1;
+
+	for (i = 1; i < nr_reactors; i++) {
+		if (reactors[i].nr_sources < reactors[best].nr_sources)
+			best = i;
+	}
+	r = &reactors[best];
+	src->reactor = best;
+
+	pthread_mutex_lock(&r->mutex);
+	src->next = r->sources;
+	r->sources = src;
+	r->nr_sources++;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+		trace_err("epoll_ctl: %s", strerror(errno));
+		r->sources = src->next;
+		r->nr_sources--;
+		pthread_mutex_unlock(&r->mutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	return 0;
+}
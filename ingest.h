@@ -0,0 +1,36 @@
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+
+/*
+ * an ingest source is one udp socket served by a reactor thread.
+ *
+ * on_input is called when the socket is readable, on_tick every
+ * tick, INGEST_TICK_MS unless ingest_set_tick() made it shorter.
+ * Both run on the reactor the source was assigned to, so a source
+ * never sees two callbacks at the same time. on_tick returns non-zero
+ * once the source has released itself, the reactor then forgets it
+ * without touching it again.
+ */
+struct ingest_source {
+	int fd;
+	int reactor;
+	void (*on_input)(struct ingest_source *src);
+	int (*on_tick)(struct ingest_source *src);
+	void *data;
+
+	struct ingest_source *next;
+};
+
+#define INGEST_MAX_REACTOR	64
+#define INGEST_TICK_MS		100
+
+int ingest_init(int nr_reactors);
+int ingest_add(struct ingest_source *src);
+int ingest_nr_reactors(void);
+void ingest_set_tick(int ms);
+long long ingest_now_ms(void);
+
+
+#endif /* _INGEST_H_ */
+
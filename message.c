@@ -10,8 +10,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "message.h"
+#include "counter.h"
 
 
 int msg_verbose_str_to_type (char *str)
@@ -48,7 +51,44 @@ void msgobj_set_name (msgobj *mo, char *name)
 	mo->name = name;
 }
 
-static void _msg_output (msgobj *mo, int type, const char *msg)
+/*
+ * asynchronous output.
+ *
+ * every thread that logs gets a ring of fixed size records, formatted
+ * in place, that a writer thread drains to stderr every MSG_FLUSH_MS.
+ * the thread is the ring's only producer and the writer its only
+ * consumer, so logging takes no lock, makes no syscall and allocates
+ * nothing after a thread's first message. a full ring drops the
+ * message and counts it, the writer reports the drops in the log.
+ * rings go back to a pool when their thread exits.
+ */
+#define MSG_RING_SLOTS	256	/* power of two */
+#define MSG_TEXT_SIZE	240	/* longer messages are cut */
+#define MSG_FLUSH_MS	20
+
+struct msg_rec {
+	const msgobj *mo;
+	int type;
+	char text[MSG_TEXT_SIZE];
+};
+
+struct msg_ring {
+	unsigned int head;	/* next record the thread writes */
+	unsigned int drops;
+	int in_use;
+	struct msg_ring *next;
+	unsigned int tail __attribute__((aligned(64)));	/* writer's */
+	unsigned int drops_seen;
+	struct msg_rec rec[MSG_RING_SLOTS];
+};
+
+static struct msg_ring *msg_rings;	/* never freed, only pushed */
+static __thread struct msg_ring *msg_local;
+static pthread_key_t msg_key;
+static pthread_once_t msg_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t msg_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void msg_write (const msgobj *mo, int type, const char *msg)
 {
 #define COL(x)  "\033[" #x ";1m"
 #define RED     COL(31)
@@ -64,25 +104,6 @@ static void _msg_output (msgobj *mo, int type, const char *msg)
 			{"error", "warning", "info", "debug", "trace"};
 	static const char *msg_color_str[] = {RED, YELLOW, BLUE, GRAY, CYAN};
 
-	switch (type) {
-		case MSG_ERR:
-			if (mo->verbose < MSG_ERR) return;
-            break;
-		case MSG_WARN:
-			if (mo->verbose < MSG_WARN) return;
-			break;
-		case MSG_INFO:
-			if (mo->verbose < MSG_INFO) return;
-			break;
-		case MSG_DBG:
-			if (mo->verbose < MSG_DBG) return;
-			break;
-		case MSG_TRACE:
-			if (mo->verbose < MSG_TRACE) return;
-			break;
-		default:
-			return;
-	}
     /* Send the message to stderr */
     if (mo->encolor)
     {
@@ -95,19 +116,135 @@ static void _msg_output (msgobj *mo, int type, const char *msg)
 			msg);
     }
 }
+
+static const msgobj msg_self = { MSG_WARN, 1, "log" };
+
+/*
+ * write out what the rings hold, return the number of records
+ */
+static int msg_drain (void)
+{
+	struct msg_ring *r;
+	struct msg_rec *rec;
+	unsigned int head, drops;
+	char buf[64];
+	int n = 0;
+
+	pthread_mutex_lock(&msg_drain_mutex);
+	for (r = __atomic_load_n(&msg_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (; r->tail != head; r->tail++, n++) {
+			rec = &r->rec[r->tail & (MSG_RING_SLOTS - 1)];
+			msg_write(rec->mo, rec->type, rec->text);
+		}
+		__atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+		drops = __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+		if (drops != r->drops_seen) {
+			snprintf(buf, sizeof(buf), "%u messages dropped, log ring full",
+				drops - r->drops_seen);
+			msg_write(&msg_self, MSG_WARN, buf);
+			r->drops_seen = drops;
+		}
+	}
+	if (n)
+		fflush(stderr);
+	pthread_mutex_unlock(&msg_drain_mutex);
+
+	return n;
+}
+
+static void *msg_writer (void *arg)
+{
+	struct timespec ts = { 0, MSG_FLUSH_MS * 1000000 };
+
+	(void)arg;
+	while (1) {
+		msg_drain();
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+/*
+ * write out everything logged so far, from the calling thread
+ */
+void msg_flush (void)
+{
+	msg_drain();
+}
+
+static void msg_ring_release (void *data)
+{
+	struct msg_ring *r = data;
+
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void msg_start (void)
+{
+	pthread_t tid;
+
+	pthread_key_create(&msg_key, msg_ring_release);
+	atexit(msg_flush);
+	if (pthread_create(&tid, NULL, msg_writer, NULL) == 0)
+		pthread_detach(tid);
+}
+
+/*
+ * the calling thread's ring, one of an exited thread or a new one
+ */
+static struct msg_ring *msg_ring_get (void)
+{
+	struct msg_ring *r;
+	int idle;
+
+	pthread_once(&msg_once, msg_start);
+	for (r = __atomic_load_n(&msg_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		idle = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &idle, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return NULL;
+		r->in_use = 1;
+		r->next = __atomic_load_n(&msg_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&msg_rings, &r->next, r, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	pthread_setspecific(msg_key, r);
+	msg_local = r;
+
+	return r;
+}
+
 void msg_output (msgobj *mo, int type, const char *fmt, va_list va)
 {
-	char *str;
-	int rc;
+	struct msg_ring *r = msg_local;
+	struct msg_rec *rec;
+	unsigned int head;
+
+	if (type < MSG_ERR || type > MSG_TRACE || mo->verbose < type)
+		return;
+	if (!r && !(r = msg_ring_get()))
+		return;
 
-	rc = vasprintf(&str, fmt, va);
-	if (rc == -1) {
-		va_end(va);
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= MSG_RING_SLOTS) {
+		__atomic_store_n(&r->drops, r->drops + 1, __ATOMIC_RELAXED);
+		counter_add(CNT_LOG_DROPS, 1);
 		return;
 	}
-	_msg_output(mo, type, str);
-	free(str);
+	rec = &r->rec[head & (MSG_RING_SLOTS - 1)];
+	rec->mo = mo;
+	rec->type = type;
+	vsnprintf(rec->text, sizeof(rec->text), fmt, va);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
 }
+
 void msg_err (msgobj *mo, const char *fmt, ...)
 {
 	va_list ap;
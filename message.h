@@ -50,6 +50,7 @@ void msgobj_set_enable_color (msgobj *mo);
 void msgobj_set_name (msgobj *mo, char *name);
 
 void msg_output (msgobj *mo, int type, const char *fmt, va_list va); 
+void msg_flush (void);
 
 void msg_err (msgobj *mo, const char *fmt, ...);
 void msg_warn (msgobj *mo, const char *fmt, ...);
@@ -57,11 +58,29 @@ void msg_info (msgobj *mo, const char *fmt, ...);
 void msg_dbg (msgobj *mo, const char *fmt, ...);
 void msg_trace (msgobj *mo, const char *fmt, ...);
 
-#define trace_err(fmt, arg...) 		msg_err(&mo, fmt, ## arg)
-#define trace_warn(fmt, arg...)		msg_warn(&mo, fmt, ## arg)
-#define trace_info(fmt, arg...) 	msg_info(&mo, fmt, ## arg)
-#define trace_dbg(fmt, arg...) 		msg_dbg(&mo, fmt, ## arg)
-#define trace_trace(fmt, arg...) 	msg_trace(&mo, fmt, ## arg)
+/*
+ * the most verbose message type built in, a build option: anything
+ * above it compiles to nothing, arguments included. below it the
+ * trace_* macros test the module's verbose level inline, so a message
+ * that is off costs a load and a branch and is never formatted.
+ */
+#ifndef MSG_LEVEL
+#define MSG_LEVEL	MSG_TRACE
+#endif
+
+#define msg_enabled(mo, type) \
+	((type) <= MSG_LEVEL && __builtin_expect((mo)->verbose >= (type), 0))
+
+#define trace_err(fmt, arg...) \
+	do { if (msg_enabled(&mo, MSG_ERR)) msg_err(&mo, fmt, ## arg); } while (0)
+#define trace_warn(fmt, arg...) \
+	do { if (msg_enabled(&mo, MSG_WARN)) msg_warn(&mo, fmt, ## arg); } while (0)
+#define trace_info(fmt, arg...) \
+	do { if (msg_enabled(&mo, MSG_INFO)) msg_info(&mo, fmt, ## arg); } while (0)
+#define trace_dbg(fmt, arg...) \
+	do { if (msg_enabled(&mo, MSG_DBG)) msg_dbg(&mo, fmt, ## arg); } while (0)
+#define trace_trace(fmt, arg...) \
+	do { if (msg_enabled(&mo, MSG_TRACE)) msg_trace(&mo, fmt, ## arg); } while (0)
 
 void hex_dump(const char *name, unsigned char *buf, int size);
 
@@ -22,6 +22,7 @@
 #define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005
 #else
 #define _XOPEN_SOURCE 600 // For flockfile() on Linux
+#define _GNU_SOURCE // For accept4() on Linux
 #define _LARGEFILE_SOURCE // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS // <inttypes.h> wants this for C++
 #endif
@@ -133,6 +134,7 @@ typedef long off_t;
 
 typedef HANDLE pthread_mutex_t;
 typedef struct {HANDLE signal, broadcast;} pthread_cond_t;
+typedef HANDLE sem_t;
 typedef DWORD pthread_t;
 #define pid_t HANDLE // MINGW typedefs pid_t to int. Using #define here.
 
@@ -173,6 +175,7 @@ typedef struct DIR {
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <netdb.h>
@@ -184,6 +187,10 @@ typedef struct DIR {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#include <semaphore.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -214,11 +221,16 @@ typedef int SOCKET;
 #endif // End of Windows and UNIX specific includes
 
 #include "mongoose.h"
+#include "route.h"
+#include "message.h"
 
 #define MONGOOSE_VERSION "3.0"
 #define PASSWORDS_FILE_NAME ".htpasswd"
 #define CGI_ENVIRONMENT_SIZE 4096
 #define MAX_CGI_ENVIR_VARS 128
+#define MG_OUT_BUF_SIZE 16384  // Per-connection buffered response output
+#define MG_ARENA_SIZE 16384    // Per-request allocations, see mg_arena_alloc()
+#define MG_ARENA_ALIGN 16      // Of the arena base and every block in it
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
 #if defined(DEBUG)
@@ -392,6 +404,47 @@ struct socket {
   int is_proxy;
 };
 
+#define SQ_SIZE 1024   // Accept queue cells, power of 2
+#define SQ_MASK (SQ_SIZE - 1)
+
+struct sq_cell {
+  size_t seq;          // Cell index: free to produce, +1: full to consume
+  struct socket sock;
+  uint64_t queued_us;  // When the master queued it
+};
+
+#define MAX_LISTENER_SHARDS 64
+
+// A listener shard: its own listening sockets, listening thread, accept
+// queue and workers. With more than one shard every shard binds the same
+// ports with SO_REUSEPORT and the kernel spreads new connections over
+// them, so no single accept loop sees them all.
+struct mg_shard {
+  struct mg_context *ctx;
+  struct socket *listening_sockets;
+  int num_workers;
+
+  // Accepted sockets, a bounded lock-free MPMC queue. Producers claim
+  // cells at sq_head, consumers at sq_tail; each cell's sequence number
+  // says whose turn it is. sq_sem counts queued sockets so idle workers
+  // sleep instead of spinning.
+  struct sq_cell *queue;
+  char pad0[64];
+  size_t sq_head;
+  char pad1[64];
+  size_t sq_tail;
+  char pad2[64];
+  sem_t sq_sem;
+
+  // Accept queue statistics, see mg_get_accept_stats()
+  unsigned int sq_busy;  // Workers serving a connection
+  unsigned int sq_max_depth;
+  uint64_t sq_accepted;
+  uint64_t sq_full_waits;
+  uint64_t sq_wait_us_total;
+  uint64_t sq_wait_us_max;
+};
+
 enum {
   CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
   PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, ACCESS_LOG_FILE,
@@ -400,6 +453,7 @@ enum {
   ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST, MAX_REQUEST_SIZE,
   EXTRA_MIME_TYPES, LISTENING_PORTS,
   DOCUMENT_ROOT, SSL_CERTIFICATE, NUM_THREADS, RUN_AS_USER,
+  LISTENER_SHARDS,
   NUM_OPTIONS
 };
 
@@ -426,6 +480,7 @@ static const char *config_options[] = {
   "s", "ssl_certificate", NULL,
   "t", "num_threads", "25",
   "u", "run_as_user", NULL,
+  "L", "listener_shards", "1",
   NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
@@ -437,17 +492,13 @@ struct mg_context {
   mg_callback_t user_callback;  // User-defined callback function
   void *user_data;              // User-defined data
 
-  struct socket *listening_sockets;
+  struct mg_shard *shards;
+  int num_shards;
 
   volatile int num_threads;  // Number of threads
-  pthread_mutex_t mutex;     // Protects (max|num)_threads
+  volatile int num_masters;  // Number of listening threads
+  pthread_mutex_t mutex;     // Protects (max|num)_threads, num_masters
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
-
-  struct socket queue[20];   // Accepted sockets
-  volatile int sq_head;      // Head of the socket queue
-  volatile int sq_tail;      // Tail of the socket queue
-  pthread_cond_t sq_full;    // Singaled when socket is produced
-  pthread_cond_t sq_empty;   // Signaled when socket is consumed
 };
 
 struct mg_connection {
@@ -464,6 +515,11 @@ struct mg_connection {
   int buf_size;               // Buffer size
   int request_len;            // Size of the request + headers in a buffer
   int data_len;               // Total size of data in a buffer
+  char *out;                  // Buffered response output, see mg_out_write()
+  int out_len;                // Bytes waiting in out
+  char *arena;                // Request scoped allocations
+  size_t arena_len;           // Bytes of arena handed out
+  void *arena_big;            // Heap blocks that did not fit, chained
 
   int keep_alive;
   int return_code;
@@ -612,6 +668,50 @@ static char * mg_strdup(const char *str) {
   return mg_strndup(str, strlen(str));
 }
 
+// Bump allocate from the connection's arena, or take a heap block when
+// the arena is full. Either way it is released by reset_arena(), before
+// the next request and when the connection closes, never by the caller.
+void *mg_arena_alloc(struct mg_connection *conn, size_t len) {
+  size_t off = (conn->arena_len + MG_ARENA_ALIGN - 1) &
+    ~(size_t) (MG_ARENA_ALIGN - 1);
+  void **big;
+
+  if (conn->arena != NULL && len <= MG_ARENA_SIZE &&
+      off <= MG_ARENA_SIZE - len) {
+    conn->arena_len = off + len;
+    return conn->arena + off;
+  }
+  // The link takes MG_ARENA_ALIGN bytes to keep the block aligned
+  if ((big = (void **) malloc(MG_ARENA_ALIGN + len)) == NULL) {
+    return NULL;
+  }
+  big[0] = conn->arena_big;
+  conn->arena_big = big;
+  return (char *) big + MG_ARENA_ALIGN;
+}
+
+char *mg_arena_strdup(struct mg_connection *conn, const char *str) {
+  size_t len = strlen(str);
+  char *p;
+
+  if ((p = (char *) mg_arena_alloc(conn, len + 1)) != NULL) {
+    memcpy(p, str, len + 1);
+  }
+  return p;
+}
+
+static void reset_arena(struct mg_connection *conn) {
+  void **big;
+
+  while ((big = (void **) conn->arena_big) != NULL) {
+    conn->arena_big = big[0];
+    free(big);
+  }
+  conn->arena_len = 0;
+  conn->request_info.post_data = NULL;
+  conn->request_info.post_data_len = 0;
+}
+
 // Like snprintf(), but never returns negative value, or the value
 // that is larger than a supplied buffer.
 // Thanks to Adam Zeldis to pointing snprintf()-caused vulnerability
@@ -870,6 +970,24 @@ static int pthread_cond_destroy(pthread_cond_t *cv) {
   return CloseHandle(cv->signal) && CloseHandle(cv->broadcast) ? 0 : -1;
 }
 
+static int sem_init(sem_t *sem, int pshared, unsigned int value) {
+  pshared = 0;
+  *sem = CreateSemaphore(NULL, value, LONG_MAX, NULL);
+  return *sem == NULL ? -1 : 0;
+}
+
+static int sem_wait(sem_t *sem) {
+  return WaitForSingleObject(*sem, INFINITE) == WAIT_OBJECT_0 ? 0 : -1;
+}
+
+static int sem_post(sem_t *sem) {
+  return ReleaseSemaphore(*sem, 1, NULL) == 0 ? -1 : 0;
+}
+
+static int sem_destroy(sem_t *sem) {
+  return CloseHandle(*sem) == 0 ? -1 : 0;
+}
+
 static pthread_t pthread_self(void) {
   return GetCurrentThreadId();
 }
@@ -1418,10 +1536,61 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
 }
 
 int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
+  if (conn->out_len > 0 && mg_out_flush(conn) < 0)
+    return -1;
   return (int) push(NULL, conn->client.sock, conn->ssl,
       (const char *) buf, (int64_t) len);
 }
 
+#if !defined(_WIN32)
+#define MG_WRITEV_MAX 64  // Entries handed to one writev() call
+
+// Gather write. Like mg_write(), returns the number of bytes sent, which
+// is short if the socket would block or failed half way.
+int mg_writev(struct mg_connection *conn, const struct iovec *iov, int iovcnt) {
+  struct iovec vec[MG_WRITEV_MAX];
+  int64_t sent = 0;
+  int i, n, cnt;
+
+  if (conn->out_len > 0 && mg_out_flush(conn) < 0)
+    return -1;
+
+  if (conn->ssl != NULL) {
+    for (i = 0; i < iovcnt; i++) {
+      n = (int) push(NULL, conn->client.sock, conn->ssl,
+                     (const char *) iov[i].iov_base, (int64_t) iov[i].iov_len);
+      sent += n;
+      if (n != (int) iov[i].iov_len)
+        break;
+    }
+    return (int) sent;
+  }
+
+  cnt = iovcnt > MG_WRITEV_MAX ? MG_WRITEV_MAX : iovcnt;
+  memcpy(vec, iov, cnt * sizeof(vec[0]));
+  i = 0;
+  while (i < cnt) {
+    n = writev(conn->client.sock, vec + i, cnt - i);
+    if (n <= 0)
+      break;
+    sent += n;
+    // Skip what went out, trim a partially sent entry
+    while (i < cnt && (size_t) n >= vec[i].iov_len) {
+      n -= vec[i].iov_len;
+      i++;
+    }
+    if (i < cnt) {
+      vec[i].iov_base = (char *) vec[i].iov_base + n;
+      vec[i].iov_len -= n;
+    }
+  }
+  if (i == cnt && iovcnt > cnt)
+    sent += mg_writev(conn, iov + cnt, iovcnt - cnt);
+
+  return (int) sent;
+}
+#endif // !_WIN32
+
 int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
   char buf[BUFSIZ];
   int len;
@@ -1434,6 +1603,80 @@ int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
   return mg_write(conn, buf, (size_t)len);
 }
 
+// Buffered output. Handlers append to conn->out, which goes out when it
+// fills up or the request is done, so a page made of many small pieces
+// costs a few large sends instead of one per piece.
+int mg_out_flush(struct mg_connection *conn) {
+  int len = conn->out_len;
+
+  conn->out_len = 0;
+  if (len > 0 && push(NULL, conn->client.sock, conn->ssl,
+                      conn->out, (int64_t) len) != len)
+    return -1;
+  return len;
+}
+
+int mg_out_write(struct mg_connection *conn, const void *buf, size_t len) {
+#if !defined(_WIN32)
+  struct iovec iov[2];
+  int64_t sent;
+#endif
+
+  if (len <= (size_t) (MG_OUT_BUF_SIZE - conn->out_len)) {
+    memcpy(conn->out + conn->out_len, buf, len);
+    conn->out_len += (int) len;
+    return (int) len;
+  }
+
+#if !defined(_WIN32)
+  // Does not fit: what is buffered and the new data leave in one writev()
+  if (conn->ssl == NULL) {
+    iov[0].iov_base = conn->out;
+    iov[0].iov_len = conn->out_len;
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len = len;
+    sent = conn->out_len;
+    conn->out_len = 0;
+    sent = mg_writev(conn, iov, 2) - sent;
+    return sent < 0 ? -1 : (int) sent;
+  }
+#endif
+  if (mg_out_flush(conn) < 0)
+    return -1;
+  return mg_write(conn, buf, len);
+}
+
+int mg_out_printf(struct mg_connection *conn, const char *fmt, ...) {
+  va_list ap, aq;
+  char *p;
+  int n, space;
+
+  space = MG_OUT_BUF_SIZE - conn->out_len;
+  va_start(ap, fmt);
+  va_copy(aq, ap);
+  n = vsnprintf(conn->out + conn->out_len, (size_t) space, fmt, aq);
+  va_end(aq);
+  if (n >= 0 && n < space) {
+    conn->out_len += n;
+  } else if (n >= 0 && mg_out_flush(conn) >= 0) {
+    if (n < MG_OUT_BUF_SIZE) {
+      conn->out_len = vsnprintf(conn->out, MG_OUT_BUF_SIZE, fmt, ap);
+    } else if ((p = (char *) malloc((size_t) n + 1)) != NULL) {
+      // Larger than the whole buffer, rare enough to go to the heap
+      vsnprintf(p, (size_t) n + 1, fmt, ap);
+      n = mg_write(conn, p, (size_t) n);
+      free(p);
+    } else {
+      n = -1;
+    }
+  } else {
+    n = -1;
+  }
+  va_end(ap);
+
+  return n;
+}
+
 // URL-decode input buffer into destination buffer.
 // 0-terminate the destination buffer. Return the length of decoded data.
 // form-url-encoded data differs from URI encoding in a way that it
@@ -2145,7 +2388,7 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
 
   // CGI needs it as REMOTE_USER
   if (ah->user != NULL) {
-    conn->request_info.remote_user = mg_strdup(ah->user);
+    conn->request_info.remote_user = mg_arena_strdup(conn, ah->user);
   } else {
     return 0;
   }
@@ -3294,13 +3537,14 @@ static void handle_request(struct mg_connection *conn) {
   }
 }
 
-static void close_all_listening_sockets(struct mg_context *ctx) {
+static void close_all_listening_sockets(struct mg_shard *shard) {
   struct socket *sp, *tmp;
-  for (sp = ctx->listening_sockets; sp != NULL; sp = tmp) {
+  for (sp = shard->listening_sockets; sp != NULL; sp = tmp) {
     tmp = sp->next;
     (void) closesocket(sp->sock);
     free(sp);
   }
+  shard->listening_sockets = NULL;
 }
 
 // Valid listening port specification is: [ip_address:]port[s|p]
@@ -3336,7 +3580,10 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
   return 1;
 }
 
-static int set_ports_option(struct mg_context *ctx) {
+// Open the listening sockets of one shard. Sharded listeners share their
+// ports through SO_REUSEPORT.
+static int set_ports_option(struct mg_shard *shard) {
+  struct mg_context *ctx = shard->ctx;
   const char *list = ctx->config[LISTENING_PORTS];
   int reuseaddr = 1, success = 1;
   SOCKET sock;
@@ -3358,8 +3605,13 @@ static int set_ports_option(struct mg_context *ctx) {
                setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuseaddr,
                           sizeof(reuseaddr)) != 0 ||
 #endif // !_WIN32
+#if defined(SO_REUSEPORT)
+               (ctx->num_shards > 1 &&
+                setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuseaddr,
+                           sizeof(reuseaddr)) != 0) ||
+#endif // SO_REUSEPORT
                bind(sock, &so.lsa.u.sa, so.lsa.len) != 0 ||
-               listen(sock, 20) != 0) {
+               listen(sock, SOMAXCONN) != 0) {
       closesocket(sock);
       cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
           vec.len, vec.ptr, strerror(ERRNO));
@@ -3373,13 +3625,13 @@ static int set_ports_option(struct mg_context *ctx) {
       *listener = so;
       listener->sock = sock;
       set_close_on_exec(listener->sock);
-      listener->next = ctx->listening_sockets;
-      ctx->listening_sockets = listener;
+      listener->next = shard->listening_sockets;
+      shard->listening_sockets = listener;
     }
   }
 
   if (!success) {
-    close_all_listening_sockets(ctx);
+    close_all_listening_sockets(shard);
   }
 
   return success;
@@ -3484,12 +3736,14 @@ static int check_acl(struct mg_context *ctx, const struct usa *usa) {
   return allowed == '+';
 }
 
+#if !defined(__linux__)
 static void add_to_set(SOCKET fd, fd_set *set, int *max_fd) {
   FD_SET(fd, set);
   if (fd > (SOCKET) *max_fd) {
     *max_fd = (int) fd;
   }
 }
+#endif // !__linux__
 
 #if !defined(_WIN32)
 static int set_uid_option(struct mg_context *ctx) {
@@ -3652,9 +3906,7 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
 
   // Reset request info attributes. DO NOT TOUCH is_ssl, remote_ip, remote_port
-  if (ri->remote_user != NULL) {
-    free((void *) ri->remote_user);
-  }
+  reset_arena(conn);
   ri->remote_user = ri->request_method = ri->uri = ri->http_version = NULL;
   ri->num_headers = 0;
   ri->status_code = -1;
@@ -3686,6 +3938,11 @@ static void close_socket_gracefully(SOCKET sock) {
 }
 
 static void close_connection(struct mg_connection *conn) {
+  if (conn->client.sock != INVALID_SOCKET) {
+    (void) mg_out_flush(conn);
+  }
+  conn->out_len = 0;
+
   if (conn->ssl) {
     SSL_free(conn->ssl);
     conn->ssl = NULL;
@@ -3695,8 +3952,7 @@ static void close_connection(struct mg_connection *conn) {
     close_socket_gracefully(conn->client.sock);
   }
 
-  if (conn->request_info.post_data)
-    free(conn->request_info.post_data);
+  reset_arena(conn);
 }
 
 static void discard_current_request_from_buffer(struct mg_connection *conn) {
@@ -3839,57 +4095,135 @@ static void process_new_connection(struct mg_connection *conn) {
       } else {
         handle_request(conn);
       }
+      (void) mg_out_flush(conn);
       log_access(conn);
       discard_current_request_from_buffer(conn);
     }
     // conn->peer is not NULL only for SSL-ed proxy connections
-  } while (conn->peer || (keep_alive_enabled && should_keep_alive(conn)));
+  } while (conn->client.sock != INVALID_SOCKET &&
+           (conn->peer || (keep_alive_enabled && should_keep_alive(conn))));
 }
 
-// Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
-  DEBUG_TRACE(("going idle"));
+static uint64_t mg_now_us(void) {
+#if defined(_WIN32)
+  return (uint64_t) GetTickCount() * 1000;
+#else
+  struct timespec ts;
 
-  // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
-    pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif // _WIN32
+}
+
+static void atomic_max(uint64_t *p, uint64_t v) {
+  uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+  while (v > old && !__atomic_compare_exchange_n(p, &old, v, 0,
+         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
   }
-  // Master thread could wake us up without putting a socket.
-  // If this happens, it is time to exit.
-  if (ctx->stop_flag) {
-    (void) pthread_mutex_unlock(&ctx->mutex);
-    return 0;
+}
+
+// Claim a free cell and fill it. Return 0 if the queue is full.
+static int sq_push(struct mg_shard *shard, const struct socket *sp) {
+  size_t pos = __atomic_load_n(&shard->sq_head, __ATOMIC_RELAXED);
+  struct sq_cell *cell;
+  intptr_t diff;
+
+  for (;;) {
+    cell = &shard->queue[pos & SQ_MASK];
+    diff = (intptr_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+      (intptr_t) pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&shard->sq_head, &pos, pos + 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&shard->sq_head, __ATOMIC_RELAXED);
+    }
   }
-  assert(ctx->sq_head > ctx->sq_tail);
+  cell->sock = *sp;
+  cell->queued_us = mg_now_us();
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-  // Copy socket from the queue and increment tail
-  *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-  ctx->sq_tail++;
-  DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+  return 1;
+}
+
+// Take the oldest full cell. Return 0 if the queue is empty.
+static int sq_pop(struct mg_shard *shard, struct socket *sp,
+                  uint64_t *queued_us) {
+  size_t pos = __atomic_load_n(&shard->sq_tail, __ATOMIC_RELAXED);
+  struct sq_cell *cell;
+  intptr_t diff;
 
-  // Wrap pointers if needed
-  while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-    ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-    ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+  for (;;) {
+    cell = &shard->queue[pos & SQ_MASK];
+    diff = (intptr_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+      (intptr_t) (pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&shard->sq_tail, &pos, pos + 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&shard->sq_tail, __ATOMIC_RELAXED);
+    }
   }
+  *sp = cell->sock;
+  *queued_us = cell->queued_us;
+  __atomic_store_n(&cell->seq, pos + SQ_SIZE, __ATOMIC_RELEASE);
 
-  (void) pthread_cond_signal(&ctx->sq_empty);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  return 1;
+}
+
+// Worker threads take accepted socket from the queue
+static int consume_socket(struct mg_shard *shard, struct socket *sp) {
+  struct mg_context *ctx = shard->ctx;
+  uint64_t queued_us, wait_us;
+
+  DEBUG_TRACE(("going idle"));
+  for (;;) {
+    // One post per queued socket, plus one per worker on mg_stop()
+    while (sem_wait(&shard->sq_sem) != 0) {
+    }
+    if (ctx->stop_flag) {
+      return 0;
+    }
+    if (sq_pop(shard, sp, &queued_us)) {
+      break;
+    }
+  }
+  DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+
+  wait_us = mg_now_us() - queued_us;
+  __atomic_add_fetch(&shard->sq_wait_us_total, wait_us, __ATOMIC_RELAXED);
+  atomic_max(&shard->sq_wait_us_max, wait_us);
 
   return 1;
 }
 
-static void worker_thread(struct mg_context *ctx) {
+static void worker_thread(struct mg_shard *shard) {
+  struct mg_context *ctx = shard->ctx;
   struct mg_connection *conn;
   int buf_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
 
-  conn = (struct mg_connection *) calloc(1, sizeof(*conn) + buf_size);
-  conn->buf_size = buf_size;
-  conn->buf = (char *) (conn + 1);
+  // The arena first, its base rounded up to MG_ARENA_ALIGN so that the
+  // offsets mg_arena_alloc() rounds give aligned pointers
+  conn = (struct mg_connection *) calloc(1, sizeof(*conn) +
+                                         MG_ARENA_ALIGN - 1 + MG_ARENA_SIZE +
+                                         buf_size + MG_OUT_BUF_SIZE);
   assert(conn != NULL);
+  conn->buf_size = buf_size;
+  conn->arena = (char *) (((uintptr_t) (conn + 1) + MG_ARENA_ALIGN - 1) &
+                          ~(uintptr_t) (MG_ARENA_ALIGN - 1));
+  conn->buf = conn->arena + MG_ARENA_SIZE;
+  conn->out = conn->buf + buf_size;
 
-  while (ctx->stop_flag == 0 && consume_socket(ctx, &conn->client)) {
+  while (ctx->stop_flag == 0 && consume_socket(shard, &conn->client)) {
     conn->birth_time = time(NULL);
     conn->ctx = ctx;
 
@@ -3902,12 +4236,14 @@ static void worker_thread(struct mg_context *ctx) {
     conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
     conn->request_info.is_ssl = conn->client.is_ssl;
 
+    __atomic_add_fetch(&shard->sq_busy, 1, __ATOMIC_RELAXED);
     if (!conn->client.is_ssl ||
         (conn->client.is_ssl && sslize(conn, SSL_accept))) {
       process_new_connection(conn);
     }
 
     close_connection(conn);
+    __atomic_sub_fetch(&shard->sq_busy, 1, __ATOMIC_RELAXED);
   }
   free(conn);
 
@@ -3922,49 +4258,118 @@ static void worker_thread(struct mg_context *ctx) {
 }
 
 // Master thread adds accepted socket to a queue
-static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
-
-  // If the queue is full, wait
-  while (ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+static void produce_socket(struct mg_shard *shard, const struct socket *sp) {
+  struct mg_context *ctx = shard->ctx;
+  unsigned int depth, max;
+
+  // If the queue is full, workers are all busy: back off briefly. Later
+  // connections wait in the listen backlog meanwhile.
+  while (!sq_push(shard, sp)) {
+    __atomic_add_fetch(&shard->sq_full_waits, 1, __ATOMIC_RELAXED);
+    if (ctx->stop_flag) {
+      (void) closesocket(sp->sock);
+      return;
+    }
+#if defined(_WIN32)
+    Sleep(1);
+#else
+    usleep(1000);
+#endif // _WIN32
   }
-  assert(ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue));
-
-  // Copy socket to the queue and increment head
-  ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-  ctx->sq_head++;
   DEBUG_TRACE(("queued socket %d", sp->sock));
+  __atomic_add_fetch(&shard->sq_accepted, 1, __ATOMIC_RELAXED);
 
-  (void) pthread_cond_signal(&ctx->sq_full);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  depth = (unsigned int) (__atomic_load_n(&shard->sq_head, __ATOMIC_RELAXED) -
+                          __atomic_load_n(&shard->sq_tail, __ATOMIC_RELAXED));
+  max = __atomic_load_n(&shard->sq_max_depth, __ATOMIC_RELAXED);
+  while (depth > max && !__atomic_compare_exchange_n(&shard->sq_max_depth,
+         &max, depth, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+
+  (void) sem_post(&shard->sq_sem);
 }
 
-static void accept_new_connection(const struct socket *listener,
-                                  struct mg_context *ctx) {
+// Accept one connection from the listener and queue it. Return 0 when
+// there was nothing to accept.
+static int accept_new_connection(const struct socket *listener,
+                                 struct mg_shard *shard) {
+  struct mg_context *ctx = shard->ctx;
   struct socket accepted;
   int allowed;
 
   accepted.rsa.len = sizeof(accepted.rsa.u.sin);
   accepted.lsa = listener->lsa;
-  accepted.sock = accept(listener->sock, &accepted.rsa.u.sa, &accepted.rsa.len);
-  if (accepted.sock != INVALID_SOCKET) {
-    allowed = check_acl(ctx, &accepted.rsa);
-    if (allowed) {
-      // Put accepted socket structure into the queue
-      DEBUG_TRACE(("accepted socket %d", accepted.sock));
-      accepted.is_ssl = listener->is_ssl;
-      accepted.is_proxy = listener->is_proxy;
-      produce_socket(ctx, &accepted);
-    } else {
-      cry(fc(ctx), "%s: %s is not allowed to connect",
-          __func__, inet_ntoa(accepted.rsa.u.sin.sin_addr));
-      (void) closesocket(accepted.sock);
-    }
+#if defined(__linux__)
+  // Not inherited from the non-blocking listener: workers want blocking IO
+  accepted.sock = accept4(listener->sock, &accepted.rsa.u.sa,
+                          &accepted.rsa.len, SOCK_CLOEXEC);
+#else
+  accepted.sock = accept(listener->sock, &accepted.rsa.u.sa,
+                         &accepted.rsa.len);
+#endif // __linux__
+  if (accepted.sock == INVALID_SOCKET) {
+    return 0;
+  }
+
+  allowed = check_acl(ctx, &accepted.rsa);
+  if (allowed) {
+    // Put accepted socket structure into the queue
+    DEBUG_TRACE(("accepted socket %d", accepted.sock));
+    accepted.is_ssl = listener->is_ssl;
+    accepted.is_proxy = listener->is_proxy;
+    produce_socket(shard, &accepted);
+  } else {
+    cry(fc(ctx), "%s: %s is not allowed to connect",
+        __func__, inet_ntoa(accepted.rsa.u.sin.sin_addr));
+    (void) closesocket(accepted.sock);
   }
+
+  return 1;
 }
 
-static void master_thread(struct mg_context *ctx) {
+#if defined(__linux__)
+#define MASTER_MAX_EVENTS 16
+#define MASTER_ACCEPT_BURST 64 // Per listener per wakeup, keeps it fair
+
+// Non-blocking listeners in an epoll set. Each wakeup drains up to
+// MASTER_ACCEPT_BURST connections, so a reconnect storm costs one
+// epoll_wait() per burst instead of one select() per connection.
+static void master_loop(struct mg_shard *shard) {
+  struct mg_context *ctx = shard->ctx;
+  struct epoll_event ev, events[MASTER_MAX_EVENTS];
+  struct socket *sp;
+  int epfd, i, j, n;
+
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    cry(fc(ctx), "%s: epoll_create1: %s", __func__, strerror(ERRNO));
+    return;
+  }
+  for (sp = shard->listening_sockets; sp != NULL; sp = sp->next) {
+    set_non_blocking_mode(sp->sock);
+    ev.events = EPOLLIN;
+    ev.data.ptr = sp;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sp->sock, &ev) != 0) {
+      cry(fc(ctx), "%s: epoll_ctl: %s", __func__, strerror(ERRNO));
+    }
+  }
+
+  while (ctx->stop_flag == 0) {
+    n = epoll_wait(epfd, events, MASTER_MAX_EVENTS, 200);
+    for (i = 0; i < n; i++) {
+      sp = (struct socket *) events[i].data.ptr;
+      for (j = 0; j < MASTER_ACCEPT_BURST && ctx->stop_flag == 0; j++) {
+        if (!accept_new_connection(sp, shard)) {
+          break;
+        }
+      }
+    }
+  }
+
+  (void) close(epfd);
+}
+#else
+static void master_loop(struct mg_shard *shard) {
+  struct mg_context *ctx = shard->ctx;
   fd_set read_set;
   struct timeval tv;
   struct socket *sp;
@@ -3975,7 +4380,7 @@ static void master_thread(struct mg_context *ctx) {
     max_fd = -1;
 
     // Add listening sockets to the read set
-    for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+    for (sp = shard->listening_sockets; sp != NULL; sp = sp->next) {
       add_to_set(sp->sock, &read_set, &max_fd);
     }
 
@@ -3990,23 +4395,40 @@ static void master_thread(struct mg_context *ctx) {
       sleep(1);
 #endif // _WIN32
     } else {
-      for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+      for (sp = shard->listening_sockets; sp != NULL; sp = sp->next) {
         if (FD_ISSET(sp->sock, &read_set)) {
-          accept_new_connection(sp, ctx);
+          accept_new_connection(sp, shard);
         }
       }
     }
   }
+}
+#endif // __linux__
+
+static void master_thread(struct mg_shard *shard) {
+  struct mg_context *ctx = shard->ctx;
+  struct socket sp;
+  uint64_t queued_us;
+  int i, last;
+
+  master_loop(shard);
   DEBUG_TRACE(("stopping workers"));
 
   // Stop signal received: somebody called mg_stop. Quit.
-  close_all_listening_sockets(ctx);
+  close_all_listening_sockets(shard);
 
   // Wakeup workers that are waiting for connections to handle.
-  pthread_cond_broadcast(&ctx->sq_full);
+  for (i = 0; i < shard->num_workers; i++) {
+    (void) sem_post(&shard->sq_sem);
+  }
 
-  // Wait until all threads finish
+  // The last listening thread out waits for all workers and cleans up
   (void) pthread_mutex_lock(&ctx->mutex);
+  last = --ctx->num_masters == 0;
+  if (!last) {
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return;
+  }
   while (ctx->num_threads > 0) {
     (void) pthread_cond_wait(&ctx->cond, &ctx->mutex);
   }
@@ -4015,8 +4437,15 @@ static void master_thread(struct mg_context *ctx) {
   // All threads exited, no sync is needed. Destroy mutex and condvars
   (void) pthread_mutex_destroy(&ctx->mutex);
   (void) pthread_cond_destroy(&ctx->cond);
-  (void) pthread_cond_destroy(&ctx->sq_empty);
-  (void) pthread_cond_destroy(&ctx->sq_full);
+  for (i = 0; i < ctx->num_shards; i++) {
+    shard = &ctx->shards[i];
+    (void) sem_destroy(&shard->sq_sem);
+
+    // Close what no worker picked up
+    while (sq_pop(shard, &sp, &queued_us)) {
+      (void) closesocket(sp.sock);
+    }
+  }
 
   // Signal mg_stop() that we're done
   ctx->stop_flag = 2;
@@ -4024,6 +4453,64 @@ static void master_thread(struct mg_context *ctx) {
   DEBUG_TRACE(("exiting"));
 }
 
+// Allocate the listener shards and their accept queues. 0 shards means
+// one per online CPU.
+static int set_shards_option(struct mg_context *ctx) {
+  struct mg_shard *shard;
+  int i, j, n = atoi(ctx->config[LISTENER_SHARDS]);
+
+#if !defined(_WIN32)
+  if (n <= 0) {
+    n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+#endif // !_WIN32
+#if !defined(SO_REUSEPORT)
+  if (n > 1) {
+    cry(fc(ctx), "%s: no SO_REUSEPORT, using one listener", __func__);
+    n = 1;
+  }
+#endif // !SO_REUSEPORT
+  if (n <= 0) {
+    n = 1;
+  }
+  if (n > MAX_LISTENER_SHARDS) {
+    n = MAX_LISTENER_SHARDS;
+  }
+
+  if ((ctx->shards = (struct mg_shard *)
+       calloc(n, sizeof(*ctx->shards))) == NULL) {
+    cry(fc(ctx), "Cannot allocate listener shards");
+    return 0;
+  }
+  ctx->num_shards = n;
+  for (i = 0; i < n; i++) {
+    shard = &ctx->shards[i];
+    shard->ctx = ctx;
+    if ((shard->queue = (struct sq_cell *)
+         calloc(SQ_SIZE, sizeof(*shard->queue))) == NULL) {
+      cry(fc(ctx), "Cannot allocate accept queue");
+      return 0;
+    }
+    for (j = 0; j < SQ_SIZE; j++) {
+      shard->queue[j].seq = j;
+    }
+  }
+
+  return 1;
+}
+
+static int set_shard_ports_option(struct mg_context *ctx) {
+  int i;
+
+  for (i = 0; i < ctx->num_shards; i++) {
+    if (!set_ports_option(&ctx->shards[i])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
 static void free_context(struct mg_context *ctx) {
   int i;
 
@@ -4033,6 +4520,15 @@ static void free_context(struct mg_context *ctx) {
       free(ctx->config[i]);
   }
 
+  // Deallocate listener shards
+  if (ctx->shards != NULL) {
+    for (i = 0; i < ctx->num_shards; i++) {
+      close_all_listening_sockets(&ctx->shards[i]);
+      free(ctx->shards[i].queue);
+    }
+    free(ctx->shards);
+  }
+
   // Deallocate SSL context
   if (ctx->ssl_ctx != NULL) {
     SSL_CTX_free(ctx->ssl_ctx);
@@ -4064,8 +4560,9 @@ void mg_stop(struct mg_context *ctx) {
 struct mg_context *mg_start_3(mg_callback_t user_callback, void *user_data,
                             const char **options) {
   struct mg_context *ctx;
+  struct mg_shard *shard;
   const char *name, *value, *default_value;
-  int i;
+  int i, j, n, num_threads;
 
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
   WSADATA data;
@@ -4103,13 +4600,18 @@ struct mg_context *mg_start_3(mg_callback_t user_callback, void *user_data,
     }
   }
 
+  if (!set_shards_option(ctx)) {
+    free_context(ctx);
+    return NULL;
+  }
+
   // NOTE(lsm): order is important here. SSL certificates must
   // be initialized before listening ports. UID must be set last.
   if (!set_gpass_option(ctx) ||
 #if !defined(NO_SSL)
       !set_ssl_option(ctx) ||
 #endif
-      !set_ports_option(ctx) ||
+      !set_shard_ports_option(ctx) ||
 #if !defined(_WIN32)
       !set_uid_option(ctx) ||
 #endif
@@ -4126,18 +4628,28 @@ struct mg_context *mg_start_3(mg_callback_t user_callback, void *user_data,
 
   (void) pthread_mutex_init(&ctx->mutex, NULL);
   (void) pthread_cond_init(&ctx->cond, NULL);
-  (void) pthread_cond_init(&ctx->sq_empty, NULL);
-  (void) pthread_cond_init(&ctx->sq_full, NULL);
 
-  // Start master (listening) thread
-  start_thread(ctx, (mg_thread_func_t) master_thread, ctx);
-
-  // Start worker threads
-  for (i = 0; i < atoi(ctx->config[NUM_THREADS]); i++) {
-    if (start_thread(ctx, (mg_thread_func_t) worker_thread, ctx) != 0) {
-      cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
-    } else {
-      ctx->num_threads++;
+  // Start master (listening) threads, then share the workers out
+  num_threads = atoi(ctx->config[NUM_THREADS]);
+  ctx->num_masters = ctx->num_shards;
+  for (i = 0; i < ctx->num_shards; i++) {
+    shard = &ctx->shards[i];
+    (void) sem_init(&shard->sq_sem, 0, 0);
+    start_thread(ctx, (mg_thread_func_t) master_thread, shard);
+
+    n = num_threads / ctx->num_shards + (i < num_threads % ctx->num_shards);
+    if (n < 1) {
+      n = 1;
+    }
+    for (j = 0; j < n; j++) {
+      if (start_thread(ctx, (mg_thread_func_t) worker_thread, shard) != 0) {
+        cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
+      } else {
+        (void) pthread_mutex_lock(&ctx->mutex);
+        ctx->num_threads++;
+        (void) pthread_mutex_unlock(&ctx->mutex);
+        shard->num_workers++;
+      }
     }
   }
 
@@ -4153,7 +4665,8 @@ struct mg_context *mg_start_3(mg_callback_t user_callback, void *user_data,
  * Semantic is the same as for mg_get_var().
  */
 static char *
-get_var(const char *name, const char *buf, size_t buf_len)
+get_var(struct mg_connection *conn, const char *name, const char *buf,
+	size_t buf_len)
 {
 	const char	*p, *e, *s;
 	char		*val;
@@ -4178,7 +4691,7 @@ get_var(const char *name, const char *buf, size_t buf_len)
 
 			/* Try to allocate the buffer */
 			len = s - p;
-			if ((val = (char *) malloc(len + 1)) != NULL)
+			if ((val = (char *) mg_arena_alloc(conn, len + 1)) != NULL)
 				(void) url_decode(p, len, val, len + 1, 1);
 			break;
 		}
@@ -4189,11 +4702,11 @@ get_var(const char *name, const char *buf, size_t buf_len)
 /*
  * Return form data variable.
  * It can be specified in query string, or in the POST data.
- * Return NULL if the variable not found, or allocated 0-terminated value.
- * It is caller's responsibility to free the returned value.
+ * Return NULL if the variable not found, or 0-terminated value from the
+ * request arena, valid until the request is done. Do not free it.
  */
 char *
-mg_get_var(const struct mg_connection *conn, const char *name)
+mg_get_var(struct mg_connection *conn, const char *name)
 {
 	const struct mg_request_info	*ri = &conn->request_info;
 	char				*v1, *v2;
@@ -4202,14 +4715,12 @@ mg_get_var(const struct mg_connection *conn, const char *name)
 
 	/* Look in both query_string and POST data */
 	if (ri->query_string != NULL)
-		v1 = get_var(name, ri->query_string, strlen(ri->query_string));
+		v1 = get_var(conn, name, ri->query_string,
+		    strlen(ri->query_string));
 	if (ri->post_data_len > 0)
-		v2 = get_var(name, ri->post_data, ri->post_data_len);
+		v2 = get_var(conn, name, ri->post_data, ri->post_data_len);
 
 	/* If they both have queried variable, POST data wins */
-	if (v1 != NULL && v2 != NULL)
-		free(v1);
-
 	return (v2 == NULL ? v1 : v2);
 }
 
@@ -4225,20 +4736,29 @@ get_content_length(const struct mg_connection *conn)
 	return (cl == NULL ? UNKNOWN_CONTENT_LENGTH : strtoull(cl, NULL, 10));
 }
 
+static msgobj mo = {
+  MSG_INFO,
+  1,
+  "mongoose",
+};
+
 struct callback_entry {
   const char *uri; 
   uri_callback_t func;
   void *user_data;
 };
-static struct callback_entry callback_table[150];
+static struct callback_entry callback_table[ROUTE_MAX];
 static int callback_cnt;
+static struct route_table uri_routes;  // Compiled in mg_start()
 
 struct error_code_callback_entry {
   int error_code;
   uri_callback_t func;
   void *user_data;
 };
-static struct error_code_callback_entry error_code_callback_table[100];
+#define MAX_ERROR_CODE_CALLBACKS 100
+static struct error_code_callback_entry
+  error_code_callback_table[MAX_ERROR_CODE_CALLBACKS];
 static int error_code_callback_cnt;
 
 
@@ -4260,29 +4780,28 @@ static void * default_callback(enum mg_event event,
                       struct mg_connection *conn,
                       const struct mg_request_info *info, void *user_data)
 {
+  struct callback_entry *cb;
   int i;
 
-  printf("%s: in, event %d(%s), uri %s\n",
-          __func__, event, mg_event_str(event), info->uri);
+  trace_dbg("%s: in, event %d(%s), uri %s",
+            __func__, event, mg_event_str(event), info->uri);
 
   if (event == MG_NEW_REQUEST) {
     /* read POST data */
     int content_len = get_content_length(conn);
     if (content_len == UNKNOWN_CONTENT_LENGTH) {
-    } else if (content_len > 0) {
-      if (info->post_data)
-        free(info->post_data);
-      conn->request_info.post_data = malloc(content_len);
+    } else if (content_len > 0 &&
+               (conn->request_info.post_data =
+                mg_arena_alloc(conn, content_len)) != NULL) {
       conn->request_info.post_data_len = mg_read(conn,
             conn->request_info.post_data, content_len);
     }
 
-    for (i = 0; i < callback_cnt; i++) {
-      if (info->uri && strcmp(info->uri, callback_table[i].uri) == 0) {
-        callback_table[i].func(conn, info,
-                               callback_table[i].user_data);
-        return "processed";
-      }
+    if (info->uri &&
+        (cb = (struct callback_entry *) route_match(&uri_routes,
+                                                     info->uri)) != NULL) {
+      cb->func(conn, info, cb->user_data);
+      return "processed";
     }
   } else if (event == MG_HTTP_ERROR) {
     for (i = 0; i < error_code_callback_cnt; i++) {
@@ -4297,22 +4816,41 @@ static void * default_callback(enum mg_event event,
   return NULL;
 }
 
-void mg_bind_to_uri(struct mg_context *ctx, const char *uri_regex,
+int mg_bind_to_uri(struct mg_context *ctx, const char *uri_regex,
                     uri_callback_t func, void *user_data)
 {
-  callback_table[callback_cnt].uri = uri_regex;
-  callback_table[callback_cnt].func = func;
-  callback_table[callback_cnt].user_data = user_data;
+  struct callback_entry *cb;
+
+  if (callback_cnt >= (int) ARRAY_SIZE(callback_table)) {
+    trace_err("%s: no room for %s", __func__, uri_regex);
+    return -1;
+  }
+  cb = &callback_table[callback_cnt];
+  cb->uri = uri_regex;
+  cb->func = func;
+  cb->user_data = user_data;
+  if (route_add(&uri_routes, uri_regex, cb) != 0) {
+    trace_err("%s: cannot route %s", __func__, uri_regex);
+    return -1;
+  }
   callback_cnt++;
+
+  return 0;
 }
 
-void mg_bind_to_error_code(struct mg_context *ctx, int error_code,
+int mg_bind_to_error_code(struct mg_context *ctx, int error_code,
                     uri_callback_t func, void *user_data)
 {
+  if (error_code_callback_cnt >= MAX_ERROR_CODE_CALLBACKS) {
+    trace_err("%s: no room for %d", __func__, error_code);
+    return -1;
+  }
   error_code_callback_table[error_code_callback_cnt].error_code = error_code;
   error_code_callback_table[error_code_callback_cnt].func = func;
   error_code_callback_table[error_code_callback_cnt].user_data = user_data;
   error_code_callback_cnt++;
+
+  return 0;
 }
 
 struct option_entry {
@@ -4336,6 +4874,9 @@ void mg_set_option(struct mg_connection *conn,
 
 struct mg_context * mg_start()
 {
+  if (route_compile(&uri_routes) != 0) {
+    trace_err("%s: cannot compile uri routes", __func__);
+  }
   return mg_start_3(default_callback, NULL, (char **)option_table);
 }
 
@@ -4384,6 +4925,21 @@ int mg_set_non_blocking_mode(struct mg_connection *conn)
 	return set_non_blocking_mode(conn->client.sock);
 }
 
+int mg_detach_socket(struct mg_connection *conn)
+{
+	SOCKET sock;
+
+	if (conn->ssl != NULL)
+		return -1;
+	if (conn->out_len > 0 && mg_out_flush(conn) < 0)
+		return -1;
+
+	sock = conn->client.sock;
+	conn->client.sock = INVALID_SOCKET;
+
+	return (int) sock;
+}
+
 int mg_set_recv_buf_size(struct mg_connection *conn, int size)
 {
 	if (setsockopt(conn->client.sock, SOL_SOCKET, SO_RCVBUF,
@@ -4404,3 +4960,38 @@ int mg_set_send_buf_size(struct mg_connection *conn, int size)
 	return 0;
 }
 
+
+void mg_get_accept_stats(const struct mg_connection *conn,
+                         struct mg_accept_stats *st) {
+  struct mg_context *ctx = conn->ctx;
+  struct mg_shard *shard;
+  size_t head, tail;
+  unsigned int max;
+  unsigned long long wait_max;
+  int i;
+
+  memset(st, 0, sizeof(*st));
+  st->num_shards = ctx->num_shards;
+  for (i = 0; i < ctx->num_shards; i++) {
+    shard = &ctx->shards[i];
+    head = __atomic_load_n(&shard->sq_head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&shard->sq_tail, __ATOMIC_RELAXED);
+    st->queue_size += SQ_SIZE;
+    st->num_workers += shard->num_workers;
+    st->busy_workers += __atomic_load_n(&shard->sq_busy, __ATOMIC_RELAXED);
+    st->queue_depth += head > tail ? (unsigned int) (head - tail) : 0;
+    max = __atomic_load_n(&shard->sq_max_depth, __ATOMIC_RELAXED);
+    if (max > st->max_depth) {
+      st->max_depth = max;
+    }
+    st->accepted += __atomic_load_n(&shard->sq_accepted, __ATOMIC_RELAXED);
+    st->full_waits += __atomic_load_n(&shard->sq_full_waits,
+                                      __ATOMIC_RELAXED);
+    st->wait_us_total += __atomic_load_n(&shard->sq_wait_us_total,
+                                         __ATOMIC_RELAXED);
+    wait_max = __atomic_load_n(&shard->sq_wait_us_max, __ATOMIC_RELAXED);
+    if (wait_max > st->wait_us_max) {
+      st->wait_us_max = wait_max;
+    }
+  }
+}
@@ -149,6 +149,15 @@ int mg_modify_passwords_file(const char *passwords_file_name,
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// Send data gathered from several buffers to the client.
+//
+// Works like mg_write() over the concatenation of the buffers, using
+// writev() on plain sockets. Returns number of bytes sent, which is short
+// if a non-blocking socket would block.
+struct iovec;
+int mg_writev(struct mg_connection *, const struct iovec *iov, int iovcnt);
+
+
 // Send data to the browser using printf() semantics.
 //
 // Works exactly like mg_write(), but allows to do message formatting.
@@ -158,6 +167,27 @@ int mg_write(struct mg_connection *, const void *buf, size_t len);
 int mg_printf(struct mg_connection *, const char *fmt, ...);
 
 
+// Buffered output, preferred for pages built from many small pieces.
+//
+// mg_out_write() and mg_out_printf() append to a per-connection buffer
+// (16 Kb) that is sent when it fills up, with writev() together with the
+// data that did not fit, and after the request handler returns.
+// mg_out_printf() output has no size limit. mg_write(), mg_printf() and
+// mg_detach_socket() flush buffered output first, so the calls can be
+// mixed. Return number of bytes taken, -1 on error.
+int mg_out_write(struct mg_connection *, const void *buf, size_t len);
+int mg_out_printf(struct mg_connection *, const char *fmt, ...);
+int mg_out_flush(struct mg_connection *);
+
+
+// Request scoped memory. Bump allocated from a per-connection arena
+// (16 Kb), spilling to the heap when that is full, and all released
+// before the next request on the connection. Never free() it.
+// mg_get_var() and post_data come from here too.
+void *mg_arena_alloc(struct mg_connection *, size_t len);
+char *mg_arena_strdup(struct mg_connection *, const char *str);
+
+
 // Read data from the remote end, return number of bytes read.
 int mg_read(struct mg_connection *, void *buf, size_t len);
 
@@ -219,12 +249,15 @@ void mg_md5(char *buf, ...);
 /*
  * back campatiable function for 2.5 client declaration
  */
-char *mg_get_var(const struct mg_connection *, const char *var_name);
+char *mg_get_var(struct mg_connection *, const char *var_name);
 typedef int (*uri_callback_t)(struct mg_connection *conn, const struct mg_request_info *ri, void *data);
 
-void mg_bind_to_uri(struct mg_context *ctx, const char *uri_regex,
+// Bind handlers before mg_start(). A uri ending in "*" is a prefix route
+// ("/hls/*"), used when no exact uri matches; the longest prefix wins.
+// Return -1 when the table is full or the uri is already bound.
+int mg_bind_to_uri(struct mg_context *ctx, const char *uri_regex,
                     uri_callback_t func, void *user_data);
-void mg_bind_to_error_code(struct mg_context *ctx, int error_code,
+int mg_bind_to_error_code(struct mg_context *ctx, int error_code,
                     uri_callback_t func, void *user_data);
 void mg_set_option(struct mg_connection *conn,
                    const char *opt, const char *value);
@@ -235,9 +268,38 @@ int web_set_conn_keep_alive(struct mg_connection *conn, int value);
 int web_set_conn_return_code(struct mg_connection *conn, unsigned short value);
 unsigned short web_get_conn_return_code(struct mg_connection *conn);
 int mg_set_non_blocking_mode(struct mg_connection *conn);
+
+/*
+ * Take the client socket away from mongoose. The worker finishes the
+ * request without closing the socket and returns to the pool, the caller
+ * owns (and must close) the socket from then on. -1 for SSL connections.
+ */
+int mg_detach_socket(struct mg_connection *conn);
 int mg_set_recv_buf_size(struct mg_connection *conn, int size);
 int mg_set_send_buf_size(struct mg_connection *conn, int size);
 
+/*
+ * Accept queues between the listening threads and the workers, summed
+ * over the listener shards (max_depth, wait_us_max: worst shard) and
+ * counted since mg_start(). wait_us is the time a socket sat in the
+ * queue before a worker took it.
+ */
+struct mg_accept_stats {
+  unsigned int num_shards;
+  unsigned int queue_size;
+  unsigned int queue_depth;
+  unsigned int max_depth;
+  unsigned long long accepted;
+  unsigned long long full_waits;  // Times the queue was full on accept
+  unsigned long long wait_us_total;
+  unsigned long long wait_us_max;
+  unsigned int num_workers;
+  unsigned int busy_workers;      // Workers serving a connection
+};
+
+void mg_get_accept_stats(const struct mg_connection *conn,
+                         struct mg_accept_stats *st);
+
 
 #ifdef __cplusplus
 }
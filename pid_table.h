@@ -0,0 +1,111 @@
+#ifndef _PID_TABLE_H_
+#define _PID_TABLE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ts.h"
+#include "rate_history.h"
+
+
+/*
+ * active pid index of a channel.
+ *
+ * a transport stream carries a few dozen pids out of 8192, so the per
+ * pid state lives in a dense array in first seen order, found through
+ * a small open addressed hash. the ingest reactor is the only writer:
+ * a new entry is filled in before nr is published, and entries never
+ * move, so readers walk info[0, nr) without a lock.
+ */
+
+#define MAX_ACTIVE_PID		128
+#define PID_HASH_BITS		8	/* twice MAX_ACTIVE_PID */
+#define PID_HASH_SIZE		(1 << PID_HASH_BITS)
+#define PID_HASH_MASK		(PID_HASH_SIZE - 1)
+#define MAX_RATE_SEC		64	/* the 1 s level of rate_history */
+#define PID_CC_SEEN		0x80
+
+struct pid_info {
+	uint16_t pid;
+	uint8_t last_cc;	/* PID_CC_SEEN | cc of the last payload packet */
+	uint32_t cc_errors;
+	uint64_t count;
+
+	struct rate_history rate;	/* packets, by channel second */
+};
+
+struct pid_table {
+	int nr;
+	uint32_t overflow;	/* packets of pids that found no room */
+	uint8_t hash[PID_HASH_SIZE];	/* info index + 1, 0 is empty */
+	struct pid_info info[MAX_ACTIVE_PID];
+};
+
+static inline unsigned int pid_hash(uint16_t pid)
+{
+	return ((uint32_t)pid * 2654435761u) >> (32 - PID_HASH_BITS);
+}
+
+/*
+ * empty @t, the info entries are cleared as they are taken
+ */
+static inline void pid_table_reset(struct pid_table *t)
+{
+	t->nr = 0;
+	t->overflow = 0;
+	memset(t->hash, 0, sizeof(t->hash));
+}
+
+static inline int pid_table_nr(struct pid_table *t)
+{
+	return __atomic_load_n(&t->nr, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * writer only. the entry of @pid, added on first sight, or NULL once
+ * MAX_ACTIVE_PID pids are in use.
+ */
+static inline struct pid_info *pid_table_get(struct pid_table *t, uint16_t pid)
+{
+	unsigned int h = pid_hash(pid);
+	struct pid_info *pi;
+	int i;
+
+	while ((i = t->hash[h])) {
+		pi = &t->info[i - 1];
+		if (pi->pid == pid)
+			return pi;
+		h = (h + 1) & PID_HASH_MASK;
+	}
+
+	if (t->nr >= MAX_ACTIVE_PID) {
+		t->overflow++;
+		return NULL;
+	}
+	pi = &t->info[t->nr];
+	memset(pi, 0, sizeof(*pi));
+	pi->pid = pid;
+	t->hash[h] = t->nr + 1;
+	__atomic_store_n(&t->nr, t->nr + 1, __ATOMIC_RELEASE);
+
+	return pi;
+}
+
+/*
+ * indexes of the first @nr entries in pid order, for display
+ */
+static inline void pid_table_sort(struct pid_table *t, int nr, uint8_t *order)
+{
+	int i, j;
+	uint8_t k;
+
+	for (i = 0; i < nr; i++) {
+		k = i;
+		for (j = i; j > 0 && t->info[order[j - 1]].pid > t->info[k].pid; j--)
+			order[j] = order[j - 1];
+		order[j] = k;
+	}
+}
+
+
+#endif /* _PID_TABLE_H_ */
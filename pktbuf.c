@@ -0,0 +1,175 @@
+/*
+ * pktbuf pool
+ *
+ * slabs of PKTBUF_PER_SLAB buffers, grown on demand and kept for good.
+ * free buffers sit on a lock-free LIFO, so the most recently released
+ * (cache hot) buffer is handed out first. the list head packs a tag
+ * with the buffer index to keep the compare and swap free of ABA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pktbuf.h"
+#include "message.h"
+
+
+static msgobj mo = {
+	MSG_INFO,
+	1,
+	"pktbuf",
+};
+
+static struct pktbuf *slabs[PKTBUF_MAX_SLAB];
+static struct pktbuf null_buf;
+static pthread_once_t null_once = PTHREAD_ONCE_INIT;
+static unsigned int nr_slabs;
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* tag << 32 | (index + 1), index + 1 == 0 is the empty list */
+static uint64_t free_head;
+static unsigned int nr_free;
+
+#define FREE_IDX(h)		((uint32_t)(h))
+#define FREE_TAG(h)		((h) >> 32)
+#define FREE_HEAD(tag, idx)	(((uint64_t)(tag) << 32) | (idx))
+
+static inline struct pktbuf *pktbuf_at(uint32_t index)
+{
+	return &slabs[index / PKTBUF_PER_SLAB][index % PKTBUF_PER_SLAB];
+}
+
+static void pktbuf_push(struct pktbuf *b)
+{
+	uint64_t head = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+
+	do {
+		b->next = FREE_IDX(head);
+	} while (!__atomic_compare_exchange_n(&free_head, &head,
+			FREE_HEAD(FREE_TAG(head) + 1, b->index + 1), 0,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	__atomic_add_fetch(&nr_free, 1, __ATOMIC_RELAXED);
+}
+
+static struct pktbuf *pktbuf_pop(void)
+{
+	uint64_t head = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+	struct pktbuf *b;
+
+	do {
+		if (FREE_IDX(head) == 0)
+			return NULL;
+		/* may read a stale link, the tag makes the swap fail then */
+		b = pktbuf_at(FREE_IDX(head) - 1);
+	} while (!__atomic_compare_exchange_n(&free_head, &head,
+			FREE_HEAD(FREE_TAG(head) + 1,
+				__atomic_load_n(&b->next, __ATOMIC_RELAXED)), 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	__atomic_sub_fetch(&nr_free, 1, __ATOMIC_RELAXED);
+
+	return b;
+}
+
+static int pktbuf_grow(void)
+{
+	struct pktbuf *slab;
+	unsigned int i, base;
+
+	pthread_mutex_lock(&slab_mutex);
+	/* somebody else grew the pool while we waited */
+	if (FREE_IDX(__atomic_load_n(&free_head, __ATOMIC_ACQUIRE))) {
+		pthread_mutex_unlock(&slab_mutex);
+		return 0;
+	}
+	if (nr_slabs >= PKTBUF_MAX_SLAB) {
+		pthread_mutex_unlock(&slab_mutex);
+		trace_err("pool exhausted, %u buffers in use",
+			nr_slabs * PKTBUF_PER_SLAB);
+		return -1;
+	}
+	if (posix_memalign((void **)&slab, 64,
+			PKTBUF_PER_SLAB * sizeof(struct pktbuf))) {
+		pthread_mutex_unlock(&slab_mutex);
+		trace_err("cannot allocate slab");
+		return -1;
+	}
+	memset(slab, 0, PKTBUF_PER_SLAB * sizeof(struct pktbuf));
+	base = nr_slabs * PKTBUF_PER_SLAB;
+	slabs[nr_slabs] = slab;
+	__atomic_store_n(&nr_slabs, nr_slabs + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&slab_mutex);
+
+	/* push backwards so the first buffers come out first */
+	for (i = PKTBUF_PER_SLAB; i-- > 0; ) {
+		slab[i].index = base + i;
+		pktbuf_push(&slab[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * return a buffer holding one reference, or NULL when out of memory
+ */
+struct pktbuf *pktbuf_alloc(void)
+{
+	struct pktbuf *b;
+
+	while ((b = pktbuf_pop()) == NULL) {
+		if (pktbuf_grow())
+			return NULL;
+	}
+	b->len = 0;
+	__atomic_store_n(&b->refcnt, 1, __ATOMIC_RELEASE);
+
+	return b;
+}
+
+/*
+ * called by the last pktbuf_put()
+ */
+void pktbuf_free(struct pktbuf *b)
+{
+	pktbuf_push(b);
+}
+
+unsigned int pktbuf_pool_size(void)
+{
+	return __atomic_load_n(&nr_slabs, __ATOMIC_ACQUIRE) * PKTBUF_PER_SLAB;
+}
+
+unsigned int pktbuf_pool_free(void)
+{
+	return __atomic_load_n(&nr_free, __ATOMIC_RELAXED);
+}
+
+static void pktbuf_null_init(void)
+{
+	int i;
+
+	memset(null_buf.data, 0xFF, UDP_PKG_SIZE);
+	for (i = 0; i < UDP_PKG_SIZE; i += TS_PKT_SIZE) {
+		null_buf.data[i + 0] = TS_SYNC_BYTE;
+		null_buf.data[i + 1] = TS_NULL_PID >> 8;
+		null_buf.data[i + 2] = TS_NULL_PID & 0xFF;
+		null_buf.data[i + 3] = 0x10;	/* payload only, cc 0 */
+	}
+	null_buf.len = UDP_PKG_SIZE;
+	null_buf.index = (uint32_t)-1;
+	/* the reference nobody drops, keeps it out of the pool */
+	null_buf.refcnt = 1;
+}
+
+/*
+ * a datagram of 7 null packets, shared and never written to.
+ * returned with a reference held like pktbuf_alloc().
+ */
+struct pktbuf *pktbuf_null(void)
+{
+	pthread_once(&null_once, pktbuf_null_init);
+	pktbuf_get(&null_buf);
+
+	return &null_buf;
+}
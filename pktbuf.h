@@ -0,0 +1,67 @@
+#ifndef _PKTBUF_H_
+#define _PKTBUF_H_
+
+#include <stdint.h>
+
+#include "ts.h"
+
+
+/*
+ * refcounted datagram buffers.
+ *
+ * ingest receives into a pktbuf once, the ring and every http stream
+ * still sending it hold a reference, the last pktbuf_put() returns it
+ * to the pool. buffers come from slabs that are never released, so a
+ * stale pointer always points at some pktbuf and pktbuf_tryget() can
+ * safely refuse one that went back to the pool.
+ */
+
+#define UDP_PKG_SIZE		(TS_PKT_SIZE * 7)
+
+struct pktbuf {
+	int refcnt;
+	int len;
+	uint32_t index;		/* position in the pool */
+	uint32_t next;		/* free list link, index + 1 */
+	unsigned char data[UDP_PKG_SIZE];
+} __attribute__((aligned(64)));
+
+#define PKTBUF_PER_SLAB		1024
+#define PKTBUF_MAX_SLAB		1024
+
+struct pktbuf *pktbuf_alloc(void);
+void pktbuf_free(struct pktbuf *b);
+struct pktbuf *pktbuf_null(void);
+unsigned int pktbuf_pool_size(void);
+unsigned int pktbuf_pool_free(void);
+
+static inline void pktbuf_get(struct pktbuf *b)
+{
+	__atomic_add_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * take a reference unless @b is already back in the pool
+ */
+static inline int pktbuf_tryget(struct pktbuf *b)
+{
+	int ref = __atomic_load_n(&b->refcnt, __ATOMIC_ACQUIRE);
+
+	while (ref > 0) {
+		if (__atomic_compare_exchange_n(&b->refcnt, &ref, ref + 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+
+	return 0;
+}
+
+static inline void pktbuf_put(struct pktbuf *b)
+{
+	if (__atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		pktbuf_free(b);
+}
+
+
+#endif /* _PKTBUF_H_ */
+
@@ -0,0 +1,147 @@
+#ifndef _RATE_HISTORY_H_
+#define _RATE_HISTORY_H_
+
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+ * packet count history of one series, at four resolutions.
+ *
+ * every level is a ring of buckets indexed by bucket number (epoch /
+ * secs) % slots. packets only ever go into the 1 s bucket of the
+ * current second; once the series writes into a newer second, the
+ * finished one is rolled up into the 10 s, 1 min and 1 h buckets that
+ * hold it, and buckets a level skipped over are zeroed on the way. so
+ * a packet costs one increment, a second one roll up per level, and a
+ * series that went quiet reads back as zeros without anyone walking it.
+ *
+ * readers ask for whole buckets of a level, a window of any length is
+ * a few buckets of the coarsest level that still holds it.
+ */
+
+#define RATE_LEVELS		4
+
+struct rate_level {
+	uint32_t secs;		/* bucket width */
+	uint16_t slots;		/* buckets kept */
+	uint16_t off;		/* first bucket in rate_history.slot */
+	const char *name;
+};
+
+static const struct rate_level rate_levels[RATE_LEVELS] = {
+	{ 1,    64, 0,   "1s" },	/* a minute */
+	{ 10,   60, 64,  "10s" },	/* 10 minutes */
+	{ 60,   60, 124, "1m" },	/* an hour */
+	{ 3600, 24, 184, "1h" },	/* a day */
+};
+
+#define RATE_SLOTS		208
+
+struct rate_history {
+	uint32_t epoch;		/* newest second written, its count not rolled up */
+	uint32_t slot[RATE_SLOTS];
+};
+
+/*
+ * move @h on to second @epoch: roll the pending second up and zero
+ * the buckets every level enters
+ */
+static inline void rate_roll(struct rate_history *h, uint32_t epoch)
+{
+	const struct rate_level *lv;
+	uint32_t v = h->slot[h->epoch % rate_levels[0].slots];
+	uint32_t b, nb, gap, i;
+	int l;
+
+	for (l = 0; l < RATE_LEVELS; l++) {
+		lv = &rate_levels[l];
+		b = h->epoch / lv->secs;
+		nb = epoch / lv->secs;
+		if (l > 0)
+			h->slot[lv->off + b % lv->slots] += v;
+		gap = nb - b;
+		if (gap > lv->slots)
+			gap = lv->slots;
+		for (i = 0; i < gap; i++)
+			h->slot[lv->off + (nb - i) % lv->slots] = 0;
+	}
+	h->epoch = epoch;
+}
+
+static inline void rate_add(struct rate_history *h, uint32_t epoch,
+		uint32_t n)
+{
+	if (h->epoch != epoch)
+		rate_roll(h, epoch);
+	h->slot[epoch % rate_levels[0].slots] += n;
+}
+
+/*
+ * packets in bucket @bucket of level @l, zero once it left the ring
+ */
+static inline uint32_t rate_get(const struct rate_history *h, int l,
+		uint32_t bucket)
+{
+	const struct rate_level *lv = &rate_levels[l];
+	uint32_t last = h->epoch / lv->secs;
+	uint32_t v;
+
+	if (bucket > last || last - bucket >= lv->slots)
+		return 0;
+	v = h->slot[lv->off + bucket % lv->slots];
+	/* the pending second is not rolled up yet */
+	if (l > 0 && bucket == last)
+		v += h->slot[h->epoch % rate_levels[0].slots];
+	return v;
+}
+
+/*
+ * packets in the last @n complete buckets of level @l, as of channel
+ * second @epoch (the one still being counted)
+ */
+static inline uint64_t rate_window(const struct rate_history *h, int l,
+		uint32_t n, uint32_t epoch)
+{
+	uint32_t cur = epoch / rate_levels[l].secs;
+	uint64_t sum = 0;
+
+	if (n > cur)
+		n = cur;
+	while (n)
+		sum += rate_get(h, l, cur - n--);
+	return sum;
+}
+
+/*
+ * packets per second over the last @n complete buckets of level @l,
+ * fewer if the series is younger
+ */
+static inline uint32_t rate_avg(const struct rate_history *h, int l,
+		uint32_t n, uint32_t epoch)
+{
+	uint32_t cur = epoch / rate_levels[l].secs;
+
+	if (n > cur)
+		n = cur;
+	if (!n)
+		return 0;
+	return rate_window(h, l, n, epoch) / ((uint64_t)n * rate_levels[l].secs);
+}
+
+/*
+ * level named @name ("1s", "10s", "1m", "1h"), -1 if none
+ */
+static inline int rate_level_by_name(const char *name)
+{
+	int l;
+
+	for (l = 0; l < RATE_LEVELS; l++) {
+		if (!strcmp(rate_levels[l].name, name))
+			return l;
+	}
+	return -1;
+}
+
+
+#endif /* _RATE_HISTORY_H_ */
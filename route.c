@@ -0,0 +1,194 @@
+/*
+ * uri routing table, see route.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "route.h"
+
+
+#define ROUTE_SEED_TRIES	256
+#define ROUTE_SLOTS_MAX		(1 << 14)
+
+#define MIN(a, b)		((a) < (b) ? (a) : (b))
+
+static uint32_t route_hash(const char *s, int len, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	/* fnv alone spreads the low bits poorly for short keys */
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+
+	return h;
+}
+
+/*
+ * add @uri, a trailing "*" makes it a prefix route, which must end in
+ * '/' before the "*" as matching only tries the uri up to each '/'.
+ * the first route added for a uri wins. -1 when full, compiled, a
+ * duplicate or a prefix not ending in '/'.
+ */
+int route_add(struct route_table *t, const char *uri, void *data)
+{
+	struct route *r;
+	int i, len = strlen(uri), prefix = 0;
+
+	if (t->compiled || t->nr >= ROUTE_MAX || len == 0)
+		return -1;
+	if (uri[len - 1] == '*') {
+		prefix = 1;
+		len--;
+		if (len == 0 || uri[len - 1] != '/')
+			return -1;
+	}
+	for (i = 0; i < t->nr; i++) {
+		r = &t->routes[i];
+		if (r->prefix == prefix && r->len == len &&
+		    !memcmp(r->uri, uri, len))
+			return -1;
+	}
+
+	r = &t->routes[t->nr++];
+	r->uri = uri;
+	r->len = len;
+	r->prefix = prefix;
+	r->data = data;
+	if (prefix && len > t->max_prefix_len)
+		t->max_prefix_len = len;
+
+	return 0;
+}
+
+/*
+ * find a seed that puts every route of the kind into its own slot,
+ * doubling the table until one does
+ */
+static int route_hash_build(struct route_table *t, struct route_hash *h,
+		int prefix)
+{
+	unsigned int size, n = 0, i, try;
+	struct route *r;
+	uint32_t seed, k;
+	short *slot;
+
+	for (i = 0; i < (unsigned int)t->nr; i++)
+		n += t->routes[i].prefix == prefix;
+	for (size = 8; size < 2 * n; size <<= 1)
+		;
+
+	for (; size <= ROUTE_SLOTS_MAX; size <<= 1) {
+		slot = malloc(size * sizeof(*slot));
+		if (!slot)
+			return -1;
+		for (try = 0; try < ROUTE_SEED_TRIES; try++) {
+			seed = try * 0x9E3779B9u;
+			memset(slot, 0, size * sizeof(*slot));
+			for (i = 0; i < (unsigned int)t->nr; i++) {
+				r = &t->routes[i];
+				if (r->prefix != prefix)
+					continue;
+				k = route_hash(r->uri, r->len, seed) & (size - 1);
+				if (slot[k])
+					break;
+				slot[k] = i + 1;
+			}
+			if (i == (unsigned int)t->nr) {
+				h->seed = seed;
+				h->mask = size - 1;
+				h->slot = slot;
+				return 0;
+			}
+		}
+		free(slot);
+	}
+
+	return -1;
+}
+
+int route_compile(struct route_table *t)
+{
+	if (t->compiled)
+		return 0;
+	if (route_hash_build(t, &t->exact, 0) ||
+	    route_hash_build(t, &t->prefix, 1)) {
+		free(t->exact.slot);
+		t->exact.slot = NULL;
+		return -1;
+	}
+	t->compiled = 1;
+
+	return 0;
+}
+
+static inline const struct route *route_probe(const struct route_table *t,
+		const struct route_hash *h, const char *uri, int len)
+{
+	int i = h->slot[route_hash(uri, len, h->seed) & h->mask];
+	const struct route *r;
+
+	if (!i)
+		return NULL;
+	r = &t->routes[i - 1];
+	if (r->len != len || memcmp(r->uri, uri, len))
+		return NULL;
+
+	return r;
+}
+
+/*
+ * linear scan for a table that was never compiled
+ */
+static void *route_match_slow(const struct route_table *t, const char *uri)
+{
+	const struct route *r, *best = NULL;
+	int i, len = strlen(uri);
+
+	for (i = 0; i < t->nr; i++) {
+		r = &t->routes[i];
+		if (!r->prefix) {
+			if (r->len == len && !memcmp(r->uri, uri, len))
+				return r->data;
+		} else if (r->len <= len && !memcmp(r->uri, uri, r->len) &&
+			   (!best || r->len > best->len)) {
+			best = r;
+		}
+	}
+
+	return best ? best->data : NULL;
+}
+
+/*
+ * data of the exact route for @uri, else of its longest prefix route
+ */
+void *route_match(const struct route_table *t, const char *uri)
+{
+	const struct route *r;
+	int len, i;
+
+	if (!t->compiled)
+		return route_match_slow(t, uri);
+
+	len = strlen(uri);
+	if ((r = route_probe(t, &t->exact, uri, len)))
+		return r->data;
+	if (!t->max_prefix_len)
+		return NULL;
+
+	for (i = MIN(len, t->max_prefix_len); i > 0; i--) {
+		if (uri[i - 1] != '/')
+			continue;
+		if ((r = route_probe(t, &t->prefix, uri, i)))
+			return r->data;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef _ROUTE_H_
+#define _ROUTE_H_
+
+#include <stdint.h>
+
+
+/*
+ * uri routing table
+ *
+ * routes are added at startup and then compiled into two perfect hash
+ * tables, one for exact uris and one for prefix routes: "/hls/" with a
+ * trailing '*' matches everything under "/hls/". a lookup is one hash
+ * probe for an exact uri, then one probe per '/' of the uri for the
+ * longest prefix. the compiled table is read only, any number of threads
+ * may match.
+ */
+
+#define ROUTE_MAX		150
+
+struct route {
+	const char *uri;	/* exact uri, or prefix up to and with the '/' */
+	int len;
+	int prefix;
+	void *data;
+};
+
+struct route_hash {
+	uint32_t seed;
+	uint32_t mask;
+	short *slot;		/* route index + 1, 0 is empty */
+};
+
+struct route_table {
+	struct route routes[ROUTE_MAX];
+	int nr;
+	int compiled;
+	int max_prefix_len;
+	struct route_hash exact;
+	struct route_hash prefix;
+};
+
+int route_add(struct route_table *t, const char *uri, void *data);
+int route_compile(struct route_table *t);
+void *route_match(const struct route_table *t, const char *uri);
+
+
+#endif /* _ROUTE_H_ */
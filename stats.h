@@ -0,0 +1,107 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+#include "pid_table.h"
+
+
+/*
+ * per channel statistics snapshots.
+ *
+ * the thread that owns a set of counters copies them into a snapshot
+ * every STATS_SNAP_MS under a sequence count. readers copy the snapshot
+ * out and retry if the count was odd or moved meanwhile, so neither
+ * side ever waits on a lock and a reader always sees one coherent
+ * moment of the channel.
+ */
+
+#define STATS_SNAP_MS		100
+
+static inline void seq_write_begin(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_write_end(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int seq_read_begin(const unsigned int *seq)
+{
+	unsigned int s;
+
+	while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return s;
+}
+
+static inline int seq_read_retry(const unsigned int *seq, unsigned int s)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
+
+/* rates are packets per second over the last complete 1 s, 10 s,
+ * 1 min, and the last hour of 1 min buckets */
+struct pid_stats {
+	uint16_t pid;
+	uint16_t reserved;
+	uint32_t cc_errors;
+	uint64_t count;
+	uint32_t rate;
+	uint32_t rate_10s;
+	uint32_t rate_1m;
+	uint32_t rate_1h;
+};
+
+/* published by the ingest reactor */
+struct chan_stats {
+	uint64_t key;		/* group address << 16 | port */
+	uint32_t epoch;		/* channel seconds */
+	uint32_t rate_dgrams;	/* datagrams in the last full second */
+	uint32_t rate_bytes;	/* bytes in the last full second */
+	uint32_t udp_drops;	/* dropped by the kernel, socket full */
+	uint64_t dgrams;
+	uint64_t bytes;
+	uint32_t sync_resyncs;
+	uint32_t sync_skipped;
+	uint32_t stalls;
+	uint32_t pid_overflow;
+	uint64_t stall_ms;
+	uint64_t null_dgrams;
+	uint32_t nr_pids;
+	uint32_t nr_clients;	/* from the egress snapshot */
+	struct pid_stats pids[MAX_ACTIVE_PID];
+};
+
+/* published by the egress worker */
+struct client_stats {
+	uint32_t ip;
+	uint16_t port;
+	uint16_t slot;
+	int64_t start_time;
+	uint64_t send_bytes;
+	uint64_t discard_bytes;
+};
+
+/*
+ * binary form of /api/stats, host byte order: a struct stats_bin_hdr,
+ * then up to the end of the response per channel a struct chan_stats
+ * cut at chan_size (its pids array left out), nr_pids struct pid_stats
+ * and nr_clients struct client_stats.
+ */
+#define STATS_BIN_MAGIC		0x53565452	/* "RTVS" */
+#define STATS_BIN_VERSION	3
+
+struct stats_bin_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t chan_size;
+	int64_t time;
+};
+
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,190 @@
+/*
+ * persistent statistics segment, see stats_shm.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats_shm.h"
+#include "message.h"
+
+
+static msgobj mo = {
+	MSG_INFO,
+	1,
+	"stats",
+};
+
+
+static struct stats_shm_hdr *shm_hdr;
+static struct stats_shm_chan *shm_slots;
+static unsigned char *shm_busy;		/* slot owned by a running channel */
+static int shm_nr;
+
+static int stats_shm_valid(const struct stats_shm_hdr *h, int nr_slots)
+{
+	int l;
+
+	if (h->magic != STATS_SHM_MAGIC || h->version != STATS_SHM_VERSION ||
+	    h->hdr_size != STATS_SHM_HDR_SIZE ||
+	    h->slot_size != sizeof(struct stats_shm_chan) ||
+	    h->nr_slots != (uint32_t)nr_slots ||
+	    h->rate_slots != RATE_SLOTS || h->max_pids != MAX_ACTIVE_PID)
+		return 0;
+	for (l = 0; l < RATE_LEVELS; l++) {
+		if (h->levels[l].secs != rate_levels[l].secs ||
+		    h->levels[l].slots != rate_levels[l].slots ||
+		    h->levels[l].off != rate_levels[l].off)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * map the segment at @path with @nr_slots channel slots, keeping what
+ * a previous run left there if the layout still matches. another rtvd
+ * holding the file is an error, so is any failure to map it.
+ */
+int stats_shm_open(const char *path, int nr_slots)
+{
+	size_t size = STATS_SHM_HDR_SIZE +
+		(size_t)nr_slots * sizeof(struct stats_shm_chan);
+	struct stats_shm_hdr *h;
+	struct stats_shm_chan *sc;
+	struct stat st;
+	int fd, i, l, keep = 0;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		trace_err("stats segment %s: %s", path, strerror(errno));
+		return -1;
+	}
+	/* the lock goes with the fd, which stays open with the mapping */
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		trace_err("stats segment %s: in use by another rtvd", path);
+		close(fd);
+		return -1;
+	}
+	if (fstat(fd, &st))
+		goto fail;
+	if ((size_t)st.st_size == size) {
+		keep = 1;
+	} else if (ftruncate(fd, 0) || ftruncate(fd, size)) {
+		goto fail;
+	}
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED)
+		goto fail;
+	shm_busy = calloc(nr_slots, 1);
+	if (!shm_busy) {
+		munmap(h, size);
+		goto fail;
+	}
+
+	if (keep && !stats_shm_valid(h, nr_slots)) {
+		trace_warn("stats segment %s: layout changed, starting over", path);
+		keep = 0;
+	}
+	if (!keep) {
+		memset(h, 0, size);
+		h->version = STATS_SHM_VERSION;
+		h->hdr_size = STATS_SHM_HDR_SIZE;
+		h->slot_size = sizeof(struct stats_shm_chan);
+		h->nr_slots = nr_slots;
+		h->rate_slots = RATE_SLOTS;
+		h->max_pids = MAX_ACTIVE_PID;
+		for (l = 0; l < RATE_LEVELS; l++) {
+			h->levels[l].secs = rate_levels[l].secs;
+			h->levels[l].slots = rate_levels[l].slots;
+			h->levels[l].off = rate_levels[l].off;
+		}
+		__atomic_store_n(&h->magic, STATS_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+	h->start_time = time(NULL);
+
+	shm_hdr = h;
+	shm_slots = (struct stats_shm_chan *)((char *)h + STATS_SHM_HDR_SIZE);
+	shm_nr = nr_slots;
+
+	/*
+	 * a run that died inside a slot write left its count odd, which
+	 * would hold readers forever. even it out and give the half
+	 * written counters up.
+	 */
+	for (i = 0; keep && i < nr_slots; i++) {
+		sc = &shm_slots[i];
+		if (!(sc->seq & 1))
+			continue;
+		trace_warn("stats segment %s: slot %d torn, cleared", path, i);
+		memset(&sc->stats, 0, sizeof(sc->stats));
+		sc->epoch_time = 0;
+		__atomic_store_n(&sc->seq, sc->seq + 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+
+fail:
+	trace_err("stats segment %s: %s", path, strerror(errno));
+	close(fd);
+	return -1;
+}
+
+/*
+ * the slot of channel @key, *@found set if it holds counters from an
+ * earlier run of the channel. NULL without a segment. callers
+ * serialize claims and releases.
+ */
+struct stats_shm_chan *stats_shm_claim(uint64_t key, int *found)
+{
+	struct stats_shm_chan *sc;
+	int i, pick = -1;
+
+	*found = 0;
+	if (!shm_hdr)
+		return NULL;
+	for (i = 0; i < shm_nr; i++) {
+		if (shm_slots[i].stats.key == key && !shm_busy[i]) {
+			*found = 1;
+			pick = i;
+			break;
+		}
+		if (shm_busy[i])
+			continue;
+		/* a free slot, else the one idle the longest */
+		if (pick < 0 || (shm_slots[pick].stats.key &&
+		    (!shm_slots[i].stats.key ||
+		     shm_slots[i].update_time < shm_slots[pick].update_time)))
+			pick = i;
+	}
+	if (pick < 0)
+		return NULL;
+
+	sc = &shm_slots[pick];
+	shm_busy[pick] = 1;
+	/* torn by a writer that never finished, start it over */
+	if (sc->seq & 1) {
+		*found = 0;
+		sc->seq++;
+	}
+	if (!*found) {
+		seq_write_begin(&sc->seq);
+		memset(&sc->stats, 0, sizeof(sc->stats));
+		sc->stats.key = key;
+		sc->epoch_time = 0;
+		sc->update_time = time(NULL);
+		seq_write_end(&sc->seq);
+	}
+	return sc;
+}
+
+void stats_shm_release(struct stats_shm_chan *sc)
+{
+	if (sc)
+		shm_busy[sc - shm_slots] = 0;
+}
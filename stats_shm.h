@@ -0,0 +1,68 @@
+#ifndef _STATS_SHM_H_
+#define _STATS_SHM_H_
+
+#include <stdint.h>
+
+#include "stats.h"
+#include "rate_history.h"
+
+
+/*
+ * persistent statistics segment.
+ *
+ * a file, /dev/shm/rtvd.stats by default, mapped shared by rtvd and by
+ * any local agent that wants the counters without asking over http. it
+ * holds a struct stats_shm_hdr, padded to STATS_SHM_HDR_SIZE, then
+ * nr_slots slots of slot_size bytes, each a struct stats_shm_chan.
+ *
+ * a channel claims the slot that holds its key, else a free one, else
+ * the one idle the longest, and its ingest reactor rewrites it with
+ * every stats snapshot under the slot's sequence count, see stats.h.
+ * the slot outlives the channel: when the channel, or rtvd, starts
+ * again its counters and rate histories carry on from the slot.
+ *
+ * readers check magic, version and the sizes in the header, then per
+ * slot copy it out between seq_read_begin() and seq_read_retry(). a
+ * slot with key 0 is unused. rate[i] is the history of stats.pids[i],
+ * by channel second, its buckets laid out as described by levels[].
+ * all in host byte order.
+ */
+
+#define STATS_SHM_PATH		"/dev/shm/rtvd.stats"
+#define STATS_SHM_MAGIC		0x4d535452	/* "RTSM" */
+#define STATS_SHM_VERSION	1
+#define STATS_SHM_HDR_SIZE	4096
+
+struct stats_shm_level {
+	uint32_t secs;
+	uint16_t slots;
+	uint16_t off;
+};
+
+struct stats_shm_hdr {
+	uint32_t magic;		/* stored last */
+	uint16_t version;
+	uint16_t hdr_size;
+	uint32_t slot_size;
+	uint32_t nr_slots;
+	uint32_t rate_slots;	/* RATE_SLOTS */
+	uint32_t max_pids;	/* MAX_ACTIVE_PID */
+	int64_t start_time;	/* of the rtvd that has it mapped */
+	struct stats_shm_level levels[RATE_LEVELS];
+};
+
+struct stats_shm_chan {
+	unsigned int seq;
+	uint32_t reserved;
+	int64_t epoch_time;	/* wall clock second of stats.epoch */
+	int64_t update_time;
+	struct chan_stats stats;
+	struct rate_history rate[MAX_ACTIVE_PID];
+} __attribute__((aligned(64)));
+
+int stats_shm_open(const char *path, int nr_slots);
+struct stats_shm_chan *stats_shm_claim(uint64_t key, int *found);
+void stats_shm_release(struct stats_shm_chan *sc);
+
+
+#endif /* _STATS_SHM_H_ */
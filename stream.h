@@ -0,0 +1,144 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mongoose.h"
+#include "udp.h"
+#include "ingest.h"
+#include "ts_ring.h"
+#include "pid_table.h"
+#include "stats.h"
+#include "stats_shm.h"
+
+
+/* default runtime limits, see stream_set_limits() */
+#define UDP_PROGRAM_LIMIT	100
+#define HTTP_STREAM_LIMIT	100
+#define MAX_UDP_IDLE_TIME	10
+#define UDP_STALL_MS		50	/* default input stall threshold */
+
+enum {
+	HTTP_STREAM_STATUS_IDLE = 0,
+	HTTP_STREAM_STATUS_RUNNING,
+	HTTP_STREAM_STATUS_CLOSE,
+};
+
+
+/*
+ * an http client of a udp program. the socket is detached from the
+ * mongoose worker that accepted it and belongs to the egress engine.
+ */
+struct http_stream {
+	struct udp_program_entry *prog;
+	int sock;
+	long remote_ip;
+	int remote_port;
+	int status;
+	int active_idx;		/* in prog->active while running */
+	uint64_t send_bytes;
+	uint64_t discard_bytes;
+	time_t start_time;
+
+	/* egress state, only touched by the channel's egress worker */
+	uint64_t cursor;	/* next ring sequence to send */
+	struct pktbuf *pending;	/* datagram the socket took part of */
+	int pending_off;
+	int blocked;		/* socket full, wait for EPOLLOUT */
+};
+
+struct udp_program_entry {
+	int refcnt;		/* 0 once dead, see udp_program_tryget() */
+	uint64_t key;		/* registry key, group address << 16 | port */
+	const char *udp_addr;
+	struct udp_context *udp_ctx;
+	int sock;
+	struct ingest_source src;
+
+	/* written by ingest only, drained by egress */
+	struct ts_ring ring;
+	struct pktbuf *spare[UDP_BATCH_MAX];
+	int egress;
+	struct udp_program_entry *egress_next;
+
+	/*
+	 * running streams, dense in active[0, nr_streams): added at the
+	 * end under the mutex, removed by the egress worker, which alone
+	 * walks the array, by moving the last one into the hole. slots
+	 * of streams[] are taken in order, then reused from free_slots.
+	 */
+	pthread_mutex_t mutex;
+	int nr_streams;
+	int nr_slots_used;
+	int nr_free_slots;
+	int nr_users;
+
+	time_t idle_start_time;
+	time_t last_rate_time;
+
+	/* input stall, null stuffing at the recent datagram rate */
+	long long last_input_ms;
+	long long stall_start_ms;	/* 0 while input flows */
+	uint32_t rate_dgrams;		/* datagrams in the current second */
+	uint32_t recent_dgrams;		/* datagrams in the last full second */
+	uint32_t rate_bytes;
+	uint32_t recent_bytes;
+	uint32_t stall_stuffed;		/* null datagrams sent this stall */
+	uint32_t stalls;
+	uint64_t stall_ms;
+	uint64_t null_dgrams;
+
+	uint64_t dgrams;
+	uint64_t bytes;
+	uint32_t udp_drops;	/* kernel drops, as of the last batch */
+	uint32_t sync_skipped;	/* bytes dropped looking for a sync byte */
+	uint32_t sync_resyncs;
+	uint32_t rate_epoch;	/* seconds since the first input */
+
+	struct ss_doc *ss_cache[RATE_LEVELS];	/* last /ss renders, under mutex */
+
+	/* snapshots, see stats.h. ingest publishes the channel ... */
+	unsigned int stats_seq;
+	long long stats_ms;
+	uint32_t rates_epoch;
+	int rates_nr_pids;
+	/* ... and egress its clients */
+	unsigned int client_seq;
+	long long client_stats_ms;
+	int client_dirty;
+	uint32_t nr_client_stats;
+
+	/* the persistent copy, written along with the channel snapshot */
+	struct stats_shm_chan *shm;
+	uint32_t shm_epoch;
+	int shm_nr_pids;
+
+	/*
+	 * the big parts, reset piecemeal when the entry is reused so
+	 * that only what a channel actually used gets touched
+	 */
+	struct pid_table pids;
+	struct chan_stats stats;
+	struct rate_history rates[MAX_ACTIVE_PID];	/* of stats.pids[] */
+
+	/* from the entry's slab, stream_max_streams() of each */
+	struct http_stream *streams;
+	struct http_stream **active;
+	int *free_slots;
+	struct client_stats *client_stats;
+};
+
+void remove_http_stream(struct udp_program_entry *p, struct http_stream *s);
+void stream_set_stall_threshold(int ms);
+int stream_set_limits(int programs, int streams);
+int stream_nr_slots(void);
+int stream_max_streams(void);
+void stream_addr_str(uint64_t key, char *buf, size_t size);
+int stream_get_stats(int slot, struct chan_stats *cs,
+		struct client_stats *clients);
+
+
+#endif /* _STREAM_H_ */
+
@@ -1,10 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
 
 #include "mongoose.h"
 #include "udp.h"
+#include "stream.h"
+#include "egress.h"
+#include "counter.h"
+#include "message.h"
+#include "ts.h"
 #include "rtvd.h"
 
 
@@ -13,103 +23,236 @@ static const char *vlc_http_standard_reply = "HTTP/1.1 200 OK\r\n"
 "Cache-Control: no-cache\r\n\r\n";
 
 #define MAX(a, b)		((a) > (b) ? (a) : (b))
+#define MIN(a, b)		((a) < (b) ? (a) : (b))
 
-#define MAX_UDP_PROGRAM		100
-#define MAX_HTTP_STREAM		100
-#define MAX_UDP_IDLE_TIME	10
-#define MAX_RATE_SEC		(1 << 6)
+/* null datagrams a single tick may stuff, a quarter of the ring */
+#define MAX_STUFF_PER_TICK	(TS_RING_SLOTS / 4)
 
-enum {
-	HTTP_STREAM_STATUS_IDLE = 0,
-	HTTP_STREAM_STATUS_RUNNING,
-	HTTP_STREAM_STATUS_CLOSE,
+static msgobj mo = {
+	MSG_INFO,
+	1,
+	"stream",
 };
 
+static int stall_threshold_ms = UDP_STALL_MS;
+
+/*
+ * channel registry.
+ *
+ * entries are allocated on demand, PROG_SLAB_ENTRIES at a time, up to
+ * the program limit, and never freed: a dead entry waits in its slot
+ * for the next channel, so a stale pointer always points at some
+ * entry. a slab is calloc()ed, the kernel backs its pages as channels
+ * first write them. lookups hash the parsed (address, port) key into an
+ * open addressed index without a lock: a hit is confirmed by taking a
+ * reference, which a dead entry refuses, and checking the key again; a
+ * miss is confirmed by the index sequence not having moved. only
+ * create and destroy take prog_mutex.
+ */
+#define PROG_SLAB_ENTRIES	8
+
+static int prog_limit = UDP_PROGRAM_LIMIT;
+static int stream_limit = HTTP_STREAM_LIMIT;
+static struct udp_program_entry **prog_slabs;
+static int nr_prog_slots;		/* entries in the slabs so far */
+
+static struct udp_program_entry **prog_hash;	/* > 2 * prog_limit slots */
+static unsigned int prog_hash_bits;
+static unsigned int prog_hash_mask;
+static unsigned int prog_hash_seq;	/* odd while entries move */
+static pthread_mutex_t prog_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-struct pid_info {
-	uint32_t count;
+static int udp_program_destroy(struct udp_program_entry *p);
+static void ss_doc_put(struct ss_doc *d);
 
-	uint16_t rate_count;
-	uint16_t rate_history[MAX_RATE_SEC]
-};
+/*
+ * "a.b.c.d:port" to a registry key, 0 is never a valid key
+ */
+static uint64_t udp_addr_key(const char *udp_addr)
+{
+	char ip[INET_ADDRSTRLEN];
+	const char *delim;
+	struct in_addr in;
+	size_t len;
+	int port;
 
-struct http_stream {
-	struct mg_connection *conn;
-	struct mg_request_info *ri;
-	int status;
-	int send_bytes;
-	int discard_bytes;
-	time_t start_time;
-};
+	if (!udp_addr || !(delim = strchr(udp_addr, ':')))
+		return 0;
+	len = delim - udp_addr;
+	if (len >= sizeof(ip))
+		return 0;
+	memcpy(ip, udp_addr, len);
+	ip[len] = '\0';
+	if (!inet_aton(ip, &in))
+		return 0;
+	port = atoi(delim + 1);
+	if (port <= 0 || port > 65535)
+		return 0;
 
-struct udp_program_entry {
-	int refcnt;
-	const char *udp_addr;
-	struct udp_context *udp_ctx;
-	int sock;
-	pthread_t thread;
+	return (uint64_t)ntohl(in.s_addr) << 16 | port;
+}
 
-	pthread_mutex_t mutex;
-	struct http_stream streams[MAX_HTTP_STREAM];
-	int max_stream_index;
-	int nr_streams;
-	int nr_users;
+static inline unsigned int prog_hash_fn(uint64_t key)
+{
+	return (key * 0x9E3779B97F4A7C15ULL) >> (64 - prog_hash_bits);
+}
 
-	time_t idle_start_time;
+static int udp_program_tryget(struct udp_program_entry *p)
+{
+	int ref = __atomic_load_n(&p->refcnt, __ATOMIC_ACQUIRE);
 
-	struct pid_info pid_table[0x1FFF + 1];
-	uint16_t rate_index;
-};
+	while (ref > 0) {
+		if (__atomic_compare_exchange_n(&p->refcnt, &ref, ref + 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 1;
+	}
 
-static struct udp_program_entry udp_program_table[MAX_UDP_PROGRAM];
-static pthread_mutex_t prog_mutex = PTHREAD_MUTEX_INITIALIZER;
+	return 0;
+}
 
-static int udp_program_destroy(struct udp_program_entry *p);
+static void put_udp_program(struct udp_program_entry *p)
+{
+	__atomic_sub_fetch(&p->refcnt, 1, __ATOMIC_RELEASE);
+}
 
-static struct udp_program_entry *
-get_udp_program(const char *udp_addr)
+static struct udp_program_entry *lookup_udp_program(uint64_t key)
 {
-	int i;
-	struct udp_program_entry *p = NULL;
+	struct udp_program_entry *p;
+	unsigned int seq, i, n;
 
-	pthread_mutex_lock(&prog_mutex);
-	for (i = 0; i < MAX_UDP_PROGRAM; i++) {
-		if (udp_program_table[i].udp_addr &&
-			!strcmp(udp_program_table[i].udp_addr, udp_addr)) {
-			p = &udp_program_table[i];
-			p->refcnt++;
-			break;
+	for (;;) {
+		seq = __atomic_load_n(&prog_hash_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		i = prog_hash_fn(key);
+		for (n = 0; n <= prog_hash_mask; n++, i = (i + 1) & prog_hash_mask) {
+			p = __atomic_load_n(&prog_hash[i], __ATOMIC_ACQUIRE);
+			if (!p)
+				break;
+			if (__atomic_load_n(&p->key, __ATOMIC_RELAXED) != key ||
+			    !udp_program_tryget(p))
+				continue;
+			/* the slot may have been reused before we got it */
+			if (__atomic_load_n(&p->key, __ATOMIC_ACQUIRE) == key)
+				return p;
+			put_udp_program(p);
 		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&prog_hash_seq, __ATOMIC_RELAXED) == seq)
+			return NULL;
 	}
-	pthread_mutex_unlock(&prog_mutex);
+}
 
-	return p;
+/*
+ * index insert and delete, prog_mutex held.
+ * inserting only fills an empty slot, readers need not notice; delete
+ * shifts the rest of the probe run back so it bumps the sequence.
+ */
+static void prog_hash_insert(struct udp_program_entry *p)
+{
+	unsigned int i = prog_hash_fn(p->key);
+
+	while (prog_hash[i])
+		i = (i + 1) & prog_hash_mask;
+	__atomic_store_n(&prog_hash[i], p, __ATOMIC_RELEASE);
 }
 
-static struct udp_program_entry * get_first_udp_program()
+static void prog_hash_delete(struct udp_program_entry *p)
 {
-	int i;
-	struct udp_program_entry *p = NULL;
+	unsigned int i, j, h;
 
-	pthread_mutex_lock(&prog_mutex);
-	for (i = 0; i < MAX_UDP_PROGRAM; i++) {
-		if (udp_program_table[i].udp_addr &&
-			udp_program_table[i].udp_addr != 1) {
-			p = &udp_program_table[i];
-			p->refcnt++;
-			break;
+	i = prog_hash_fn(p->key);
+	while (prog_hash[i] != p) {
+		if (!prog_hash[i])
+			return;
+		i = (i + 1) & prog_hash_mask;
+	}
+
+	__atomic_store_n(&prog_hash_seq, prog_hash_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (j = (i + 1) & prog_hash_mask; prog_hash[j];
+	     j = (j + 1) & prog_hash_mask) {
+		/* an entry can fill the hole unless its home is in (i, j] */
+		h = prog_hash_fn(prog_hash[j]->key);
+		if (i <= j ? (h <= i || h > j) : (h <= i && h > j)) {
+			__atomic_store_n(&prog_hash[i], prog_hash[j], __ATOMIC_RELAXED);
+			i = j;
 		}
 	}
-	pthread_mutex_unlock(&prog_mutex);
+	__atomic_store_n(&prog_hash[i], NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&prog_hash_seq, prog_hash_seq + 1, __ATOMIC_RELEASE);
+}
 
-	return p;
+static struct udp_program_entry *
+get_udp_program(const char *udp_addr)
+{
+	uint64_t key = udp_addr_key(udp_addr);
+
+	return key ? lookup_udp_program(key) : NULL;
 }
 
-static void put_udp_program(struct udp_program_entry *p)
+/*
+ * entry of registry slot @i, NULL if no slab holds it yet
+ */
+static struct udp_program_entry *prog_slot(int i)
 {
-	pthread_mutex_lock(&prog_mutex);
-	p->refcnt--;
-	pthread_mutex_unlock(&prog_mutex);
+	if (i < 0 || i >= __atomic_load_n(&nr_prog_slots, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &prog_slabs[i / PROG_SLAB_ENTRIES][i % PROG_SLAB_ENTRIES];
+}
+
+/*
+ * one more slab of entries, each with its streams, prog_mutex held.
+ * returns its first entry, NULL at the program limit.
+ */
+static struct udp_program_entry *prog_slab_grow(void)
+{
+	struct udp_program_entry *e;
+	struct http_stream *s, **a;
+	struct client_stats *c;
+	int i, *f, n = nr_prog_slots;
+
+	if (n >= prog_limit)
+		return NULL;
+	e = calloc(PROG_SLAB_ENTRIES, sizeof(*e));
+	s = calloc(PROG_SLAB_ENTRIES * stream_limit, sizeof(*s));
+	a = calloc(PROG_SLAB_ENTRIES * stream_limit, sizeof(*a));
+	f = calloc(PROG_SLAB_ENTRIES * stream_limit, sizeof(*f));
+	c = calloc(PROG_SLAB_ENTRIES * stream_limit, sizeof(*c));
+	if (!e || !s || !a || !f || !c) {
+		free(e);
+		free(s);
+		free(a);
+		free(f);
+		free(c);
+		return NULL;
+	}
+	for (i = 0; i < PROG_SLAB_ENTRIES; i++) {
+		e[i].streams = s + i * stream_limit;
+		e[i].active = a + i * stream_limit;
+		e[i].free_slots = f + i * stream_limit;
+		e[i].client_stats = c + i * stream_limit;
+	}
+	prog_slabs[n / PROG_SLAB_ENTRIES] = e;
+	__atomic_store_n(&nr_prog_slots, MIN(n + PROG_SLAB_ENTRIES, prog_limit),
+		__ATOMIC_RELEASE);
+
+	return e;
+}
+
+static struct udp_program_entry * get_first_udp_program()
+{
+	struct udp_program_entry *p;
+	int i;
+
+	for (i = 0; (p = prog_slot(i)); i++) {
+		if (udp_program_tryget(p))
+			return p;
+	}
+
+	return NULL;
 }
 
 static void inc_udp_program_user(struct udp_program_entry *p)
@@ -131,27 +274,45 @@ static void dec_udp_program_user(struct udp_program_entry *p)
 
 static struct http_stream *
 add_http_stream(struct udp_program_entry *p,
-	struct mg_connection *conn, struct mg_request_info *ri)
+	int sock, long remote_ip, int remote_port)
 {
 	int i;
 	struct http_stream *s = NULL;
 
 	pthread_mutex_lock(&p->mutex);
-	for (i = 0; i < MAX_HTTP_STREAM; i++) {
-		if (p->streams[i].status != HTTP_STREAM_STATUS_RUNNING) {
-			printf("add http stream in slot #%d of udp program %s\n",
-				i, p->udp_addr);
-			mg_set_non_blocking_mode(conn);
-			p->streams[i].send_bytes = 0;
-			p->streams[i].discard_bytes = 0;
-			p->streams[i].start_time = time(NULL);
-			p->streams[i].conn = conn;
-			p->streams[i].ri = ri;
-			p->streams[i].status = HTTP_STREAM_STATUS_RUNNING;
-			p->max_stream_index = MAX(i, p->max_stream_index);
-			p->nr_streams++;
-			s = &p->streams[i];
-			break;
+	if (p->nr_free_slots)
+		i = p->free_slots[--p->nr_free_slots];
+	else if (p->nr_slots_used < stream_limit)
+		i = p->nr_slots_used++;
+	else
+		i = -1;
+	if (i >= 0) {
+		trace_info("add http stream in slot #%d of udp program %s",
+			i, p->udp_addr);
+		s = &p->streams[i];
+		s->send_bytes = 0;
+		s->discard_bytes = 0;
+		s->start_time = time(NULL);
+		s->sock = sock;
+		s->remote_ip = remote_ip;
+		s->remote_port = remote_port;
+		s->prog = p;
+		s->cursor = ts_ring_head(&p->ring);
+		s->pending = NULL;
+		s->pending_off = 0;
+		s->blocked = 0;
+		s->status = HTTP_STREAM_STATUS_RUNNING;
+		/* egress cannot remove it before the mutex is dropped */
+		if (egress_add_stream(p, s)) {
+			s->status = HTTP_STREAM_STATUS_CLOSE;
+			p->free_slots[p->nr_free_slots++] = i;
+			s = NULL;
+		} else {
+			s->active_idx = p->nr_streams;
+			p->active[p->nr_streams] = s;
+			__atomic_store_n(&p->nr_streams, p->nr_streams + 1,
+				__ATOMIC_RELEASE);
+			counter_add(CNT_HTTP_STREAMS, 1);
 		}
 	}
 	pthread_mutex_unlock(&p->mutex);
@@ -159,182 +320,553 @@ add_http_stream(struct udp_program_entry *p,
 	return s;
 }
 
-static void remove_http_stream(struct udp_program_entry *p,
-		struct http_stream *s)
+/*
+ * called by the egress engine, which owns the stream's socket and
+ * alone walks the active streams
+ */
+void remove_http_stream(struct udp_program_entry *p, struct http_stream *s)
 {
+	struct http_stream *last;
+
 	pthread_mutex_lock(&p->mutex);
 	s->status = HTTP_STREAM_STATUS_CLOSE;
-	s->conn = NULL;
-	p->nr_streams--;
+	if (s->sock >= 0)
+		close(s->sock);
+	s->sock = -1;
+	last = p->active[p->nr_streams - 1];
+	p->active[s->active_idx] = last;
+	last->active_idx = s->active_idx;
+	__atomic_store_n(&p->nr_streams, p->nr_streams - 1, __ATOMIC_RELEASE);
+	p->free_slots[p->nr_free_slots++] = s - p->streams;
 	pthread_mutex_unlock(&p->mutex);
 }
 
-#define UDP_PKG_SIZE		(188 * 7)
-
-static void * udp_program_thread(void *data)
+/*
+ * reactor callback, the udp socket is readable.
+ * datagrams are received straight into pool buffers that go into the
+ * ring as they are, unused buffers are kept for the next round.
+ */
+static void udp_program_input(struct ingest_source *src)
 {
-	struct udp_program_entry *p = (struct udp_program_entry *)data;
-	int i, rc, len;
-	unsigned char buf[UDP_PKG_SIZE];
-	time_t last_rate_time = 0;
-
-	pthread_detach(pthread_self());
-	p->idle_start_time = time(NULL);
-	while (1) {
-		/*
-		 * check for this udp quiting
-		 */
-		if (p->nr_streams <= 0 && p->nr_users <= 0) {
-			if (time(NULL) >= p->idle_start_time + MAX_UDP_IDLE_TIME) {
-				printf("%s: quit\n", p->udp_addr);
-				if (udp_program_destroy(p))
-					pthread_exit(NULL);
-			}
-			usleep(100000);
-			continue;
-		}
+	struct udp_program_entry *p = (struct udp_program_entry *)src->data;
+	struct pktbuf *b;
+	struct iovec iov[UDP_BATCH_MAX];
+	int lens[UDP_BATCH_MAX];
+	struct ts_hdr hdr[UDP_PKG_SIZE / TS_PKT_SIZE];
+	struct ts_scan_stats st = { 0, 0 };
+	struct pid_info *pi;
+	int i, j, n, nr_hdr, bytes = 0, cc_errors = 0;
+	long long now;
+	time_t t;
+
+	for (i = 0; i < UDP_BATCH_MAX; i++) {
+		if (!p->spare[i] && !(p->spare[i] = pktbuf_alloc()))
+			break;
+		iov[i].iov_base = p->spare[i]->data;
+		iov[i].iov_len = UDP_PKG_SIZE;
+	}
+	if (i == 0) {
+		/* out of buffers, drop a datagram rather than spin */
+		unsigned char sink[UDP_PKG_SIZE];
 
-		len = udp_read_data(p->udp_ctx, buf, UDP_PKG_SIZE);
-		if (len <= 0) {
-			//printf("send out last data\n");
-			memset(buf, 0xFF, UDP_PKG_SIZE);
-			for (i = 0; i < UDP_PKG_SIZE; i += 188) {
-				buf[i + 0] = 0x47;
-				buf[i + 1] = 0x1F;
-				buf[i + 2] = 0xFF;
-				buf[i + 3] = 0x00;
-			}
-			len = UDP_PKG_SIZE;
-		} else {
-			/*
-			 * track pid info
-			 */
-			time_t t = time(NULL);
-			for (i = 0; i < UDP_PKG_SIZE; i += 188) {
-				uint16_t pid = ((buf[i + 1] & 0x1F) << 8) | buf[i + 2];
-				p->pid_table[pid].count++;
-				p->pid_table[pid].rate_history[p->rate_index]++;
-			}
+		iov[0].iov_base = sink;
+		iov[0].iov_len = sizeof(sink);
+		udp_read_batch(p->udp_ctx, iov, lens, 1);
+		return;
+	}
+	n = udp_read_batch(p->udp_ctx, iov, lens, i);
+	if (n <= 0)
+		return;
 
-			/* update rate time/index */
-			if (last_rate_time) {
-				if (t != last_rate_time) {
-					if (++p->rate_index >= MAX_RATE_SEC)
-						p->rate_index = 0;
-					for (i = 0; i <= 0x1FFF; i++)
-						p->pid_table[i].rate_history[p->rate_index] = 0;
-					last_rate_time = t;
-				}
-			} else {
-				last_rate_time = t;
+	/* input is back, close the stall */
+	now = ingest_now_ms();
+	if (p->stall_start_ms) {
+		p->stall_ms += now - p->stall_start_ms;
+		p->stall_start_ms = 0;
+	}
+	p->last_input_ms = now;
+
+	/* update rate time/index, buckets reset lazily per pid */
+	t = time(NULL);
+	if (p->last_rate_time) {
+		if (t > p->last_rate_time) {
+			/* a gap leaves the last full second's rate alone */
+			if (t == p->last_rate_time + 1) {
+				p->recent_dgrams = p->rate_dgrams;
+				p->recent_bytes = p->rate_bytes;
 			}
+			p->rate_dgrams = 0;
+			p->rate_bytes = 0;
+			p->rate_epoch += t - p->last_rate_time;
+			p->last_rate_time = t;
 		}
+	} else {
+		p->last_rate_time = t;
+	}
 
-		for (i = 0; i <= p->max_stream_index; i++) {
-			if (p->streams[i].conn &&
-				p->streams[i].status == HTTP_STREAM_STATUS_RUNNING) {
-				//printf("%s: send %d data to slot #%d\n", p->udp_addr, len, i);
-				rc = mg_write(p->streams[i].conn, buf, len);
-				if (rc <= 0) {
-					if (errno == EAGAIN) {
-						p->streams[i].discard_bytes += len;
-						continue;
-					}
-					printf("http stream %s closed!\n", p->udp_addr);
-					remove_http_stream(p, &p->streams[i]);
-					if (p->nr_streams <= 0) {
-						p->idle_start_time = time(NULL);
-						printf("%s: idle start time %s\n",
-							p->udp_addr, ctime(&p->idle_start_time));
-					}
-				}
-				p->streams[i].send_bytes += len;
+	/*
+	 * track pid info
+	 */
+	for (i = 0; i < n; i++) {
+		b = p->spare[i];
+		p->spare[i] = NULL;
+		b->len = lens[i];
+		bytes += lens[i];
+		nr_hdr = ts_scan(b->data, b->len, hdr, UDP_PKG_SIZE / TS_PKT_SIZE, &st);
+		for (j = 0; j < nr_hdr; j++) {
+			pi = pid_table_get(&p->pids, hdr[j].pid);
+			if (!pi)
+				continue;
+			pi->count++;
+			rate_add(&pi->rate, p->rate_epoch, 1);
+			if (hdr[j].pid == TS_NULL_PID || !(hdr[j].flags & TS_F_PAYLOAD))
+				continue;
+			if ((pi->last_cc & PID_CC_SEEN) &&
+			    hdr[j].cc != ((pi->last_cc + 1) & 0x0F) &&
+			    hdr[j].cc != (pi->last_cc & 0x0F)) {
+				pi->cc_errors++;
+				cc_errors++;
 			}
+			pi->last_cc = PID_CC_SEEN | hdr[j].cc;
 		}
+		ts_ring_put(&p->ring, b);
+	}
+	p->sync_skipped += st.skipped;
+	p->sync_resyncs += st.resyncs;
+	p->rate_dgrams += n;
+	p->rate_bytes += bytes;
+	p->dgrams += n;
+	p->bytes += bytes;
+
+	counter_add(CNT_IN_DGRAMS, n);
+	counter_add(CNT_IN_BYTES, bytes);
+	if (cc_errors)
+		counter_add(CNT_CC_ERRORS, cc_errors);
+	if (p->udp_ctx->drops != p->udp_drops) {
+		counter_add(CNT_UDP_DROPS, p->udp_ctx->drops - p->udp_drops);
+		p->udp_drops = p->udp_ctx->drops;
 	}
 
-	return NULL;
+	egress_kick(p);
 }
 
-static struct udp_program_entry * get_free_udp_program()
+/*
+ * the snapshot just published, plus the pid rate histories whenever a
+ * second went by or the pid order changed, into the stats segment
+ */
+static void udp_program_publish_shm(struct udp_program_entry *p,
+		const uint8_t *order, int nr)
 {
+	struct stats_shm_chan *sc = p->shm;
 	int i;
-	struct udp_program_entry *p = NULL;
 
-	pthread_mutex_lock(&prog_mutex);
-	for (i = 0; i < MAX_UDP_PROGRAM; i++) {
-		if (!udp_program_table[i].udp_addr) {
-			udp_program_table[i].udp_addr = 1; // mark it used
-			p = &udp_program_table[i];
-			p->refcnt++;
-			break;
+	seq_write_begin(&sc->seq);
+	memcpy(&sc->stats, &p->stats, offsetof(struct chan_stats, pids[nr]));
+	sc->epoch_time = p->last_rate_time;
+	sc->update_time = time(NULL);
+	if (p->rate_epoch != p->shm_epoch || nr != p->shm_nr_pids) {
+		for (i = 0; i < nr; i++)
+			sc->rate[i] = p->pids.info[order[i]].rate;
+		p->shm_epoch = p->rate_epoch;
+		p->shm_nr_pids = nr;
+	}
+	seq_write_end(&sc->seq);
+}
+
+/*
+ * copy the reactor owned counters into the channel snapshot
+ */
+static void udp_program_publish_stats(struct udp_program_entry *p,
+		long long now)
+{
+	struct chan_stats *cs = &p->stats;
+	uint8_t order[MAX_ACTIVE_PID];
+	struct pid_stats *ps;
+	struct pid_info *pi;
+	int i, nr;
+
+	p->stats_ms = now;
+	nr = p->pids.nr;
+	pid_table_sort(&p->pids, nr, order);
+
+	seq_write_begin(&p->stats_seq);
+	cs->key = p->key;
+	cs->epoch = p->rate_epoch;
+	cs->rate_dgrams = p->recent_dgrams;
+	cs->rate_bytes = p->recent_bytes;
+	cs->dgrams = p->dgrams;
+	cs->bytes = p->bytes;
+	cs->udp_drops = p->udp_drops;
+	cs->sync_resyncs = p->sync_resyncs;
+	cs->sync_skipped = p->sync_skipped;
+	cs->stalls = p->stalls;
+	cs->pid_overflow = p->pids.overflow;
+	cs->stall_ms = p->stall_ms;
+	if (p->stall_start_ms)
+		cs->stall_ms += now - p->stall_start_ms;
+	cs->null_dgrams = p->null_dgrams;
+	cs->nr_pids = nr;
+	for (i = 0; i < nr; i++) {
+		pi = &p->pids.info[order[i]];
+		ps = &cs->pids[i];
+		ps->pid = pi->pid;
+		ps->rate = rate_avg(&pi->rate, 0, 1, p->rate_epoch);
+		ps->rate_10s = rate_avg(&pi->rate, 1, 1, p->rate_epoch);
+		ps->rate_1m = rate_avg(&pi->rate, 2, 1, p->rate_epoch);
+		ps->rate_1h = rate_avg(&pi->rate, 2, 60, p->rate_epoch);
+		ps->cc_errors = pi->cc_errors;
+		ps->count = pi->count;
+	}
+	/* the histories only move once a second, or with the pid order */
+	if (p->rate_epoch != p->rates_epoch || nr != p->rates_nr_pids) {
+		for (i = 0; i < nr; i++)
+			p->rates[i] = p->pids.info[order[i]].rate;
+		p->rates_epoch = p->rate_epoch;
+		p->rates_nr_pids = nr;
+	}
+	seq_write_end(&p->stats_seq);
+
+	if (p->shm)
+		udp_program_publish_shm(p, order, nr);
+}
+
+/*
+ * reactor callback, every INGEST_TICK_MS.
+ * return non-zero once the udp program is destroyed.
+ */
+static int udp_program_tick(struct ingest_source *src)
+{
+	struct udp_program_entry *p = (struct udp_program_entry *)src->data;
+	time_t t = time(NULL);
+	long long now, rate, owed;
+	int i, n;
+
+	now = ingest_now_ms();
+	if (now - p->stats_ms >= STATS_SNAP_MS)
+		udp_program_publish_stats(p, now);
+
+	/*
+	 * check for this udp quiting
+	 */
+	if (p->nr_streams <= 0 && p->nr_users <= 0) {
+		if (t >= p->idle_start_time + MAX_UDP_IDLE_TIME) {
+			trace_info("%s: quit", p->udp_addr);
+			return udp_program_destroy(p);
 		}
+		return 0;
 	}
-	pthread_mutex_unlock(&prog_mutex);
 
-	return p;
+	/*
+	 * no input for stall_threshold_ms, keep clients fed with null
+	 * packets at the rate the source had, counted from its last input
+	 */
+	if (now - p->last_input_ms < stall_threshold_ms)
+		return 0;
+	if (!p->stall_start_ms) {
+		p->stall_start_ms = p->last_input_ms;
+		p->stall_stuffed = 0;
+		p->stalls++;
+		counter_add(CNT_STALLS, 1);
+	}
+	rate = MAX(MAX(p->recent_dgrams, p->rate_dgrams), 1);
+	owed = rate * (now - p->stall_start_ms) / 1000 - p->stall_stuffed;
+	if (owed <= 0)
+		return 0;
+	n = MIN(owed, MAX_STUFF_PER_TICK);
+	for (i = 0; i < n; i++)
+		ts_ring_put(&p->ring, pktbuf_null());
+	/* what the ring could not take this tick is not owed later */
+	p->stall_stuffed += owed;
+	p->null_dgrams += n;
+	counter_add(CNT_NULL_DGRAMS, n);
+	egress_kick(p);
+
+	return 0;
 }
 
-static void put_free_udp_program(struct udp_program_entry *p)
+/*
+ * "a.b.c.d:port" of a registry key
+ */
+void stream_addr_str(uint64_t key, char *buf, size_t size)
 {
-	pthread_mutex_lock(&prog_mutex);
-	p->udp_addr = 0; // reset it
-	p->refcnt--;
-	pthread_mutex_unlock(&prog_mutex);
+	char ip[INET_ADDRSTRLEN];
+	struct in_addr in;
+
+	in.s_addr = htonl(key >> 16);
+	inet_ntop(AF_INET, &in, ip, sizeof(ip));
+	snprintf(buf, size, "%s:%u", ip, (unsigned int)(key & 0xffff));
 }
 
-static int udp_program_init(struct udp_program_entry *p, const char *udp_addr)
+/*
+ * copy the last snapshots of registry @slot, @clients
+ * (stream_max_streams() entries) may be NULL. returns the number of
+ * clients, which is also stored in cs->nr_clients, or -1 if no udp
+ * program runs in the slot.
+ */
+int stream_get_stats(int slot, struct chan_stats *cs,
+		struct client_stats *clients)
 {
-	int rc;
-	pthread_t thr;
-	char *ip = strdup(udp_addr);
-	char *delim;
-	short port;
+	struct udp_program_entry *p = prog_slot(slot);
+	unsigned int seq;
+	int n;
 
-	memset(p, 0, sizeof(*p));
+	if (!p || !udp_program_tryget(p))
+		return -1;
+	do {
+		seq = seq_read_begin(&p->stats_seq);
+		n = MIN(p->stats.nr_pids, MAX_ACTIVE_PID);
+		memcpy(cs, &p->stats, offsetof(struct chan_stats, pids[n]));
+	} while (seq_read_retry(&p->stats_seq, seq));
+	cs->nr_pids = n;
+	do {
+		seq = seq_read_begin(&p->client_seq);
+		n = MIN(p->nr_client_stats, (uint32_t)stream_limit);
+		if (clients)
+			memcpy(clients, p->client_stats, n * sizeof(*clients));
+	} while (seq_read_retry(&p->client_seq, seq));
+	cs->nr_clients = n;
+	put_udp_program(p);
 
-	/* open udp socket */
-	delim = strchr(ip, ':');
-	if (!delim) {
-		free(ip);
+	return n;
+}
+
+/*
+ * at most @programs udp programs of @streams http clients each, call
+ * once before any udp program starts
+ */
+int stream_set_limits(int programs, int streams)
+{
+	if (programs > 0)
+		prog_limit = programs;
+	if (streams > 0)
+		stream_limit = streams;
+
+	prog_slabs = calloc((prog_limit + PROG_SLAB_ENTRIES - 1) /
+		PROG_SLAB_ENTRIES, sizeof(*prog_slabs));
+	for (prog_hash_bits = 1; (1 << prog_hash_bits) <= 2 * prog_limit;
+	     prog_hash_bits++)
+		;
+	prog_hash_mask = (1 << prog_hash_bits) - 1;
+	prog_hash = calloc(prog_hash_mask + 1, sizeof(*prog_hash));
+	if (!prog_slabs || !prog_hash)
 		return -1;
+
+	return 0;
+}
+
+/*
+ * registry slots to walk with stream_get_stats(), grows with the slabs
+ */
+int stream_nr_slots(void)
+{
+	return __atomic_load_n(&nr_prog_slots, __ATOMIC_ACQUIRE);
+}
+
+int stream_max_streams(void)
+{
+	return stream_limit;
+}
+
+/*
+ * input stall threshold in ms, call before any udp program starts
+ */
+void stream_set_stall_threshold(int ms)
+{
+	if (ms > 0)
+		stall_threshold_ms = ms;
+}
+
+/*
+ * carry on from the counters an earlier run of the channel left in
+ * its stats segment slot. the first input after the gap moves the
+ * channel seconds on, and the rate histories with them.
+ */
+static void udp_program_restore(struct udp_program_entry *p)
+{
+	struct stats_shm_chan *sc = p->shm;
+	const struct chan_stats *cs = &sc->stats;
+	struct pid_info *pi;
+	int i, nr;
+
+	p->rate_epoch = cs->epoch;
+	p->last_rate_time = sc->epoch_time;
+	p->dgrams = cs->dgrams;
+	p->bytes = cs->bytes;
+	p->sync_resyncs = cs->sync_resyncs;
+	p->sync_skipped = cs->sync_skipped;
+	p->stalls = cs->stalls;
+	p->stall_ms = cs->stall_ms;
+	p->null_dgrams = cs->null_dgrams;
+	p->pids.overflow = cs->pid_overflow;
+	nr = MIN(cs->nr_pids, MAX_ACTIVE_PID);
+	for (i = 0; i < nr; i++) {
+		pi = pid_table_get(&p->pids, cs->pids[i].pid);
+		if (!pi)
+			continue;
+		pi->count = cs->pids[i].count;
+		pi->cc_errors = cs->pids[i].cc_errors;
+		pi->rate = sc->rate[i];
 	}
-	*delim = 0;
-	port = atoi(delim + 1);
+}
+
+/*
+ * clear a dead entry for reuse, leaving the pid info and snapshot
+ * arrays and the slab's parts alone
+ */
+static void udp_program_reset(struct udp_program_entry *p)
+{
+	memset(p, 0, offsetof(struct udp_program_entry, pids));
+	pid_table_reset(&p->pids);
+	memset(&p->stats, 0, offsetof(struct chan_stats, pids));
+}
+
+/*
+ * set up a free registry entry for @udp_addr, prog_mutex held.
+ * the entry is published with two references, the reactor's own and
+ * the caller's.
+ */
+static int udp_program_init(struct udp_program_entry *p, const char *udp_addr,
+		uint64_t key)
+{
+	char ip[INET_ADDRSTRLEN];
+	struct in_addr in;
+	int found;
+
+	udp_program_reset(p);
 
-	p->udp_ctx = udp_open(ip, port);
+	/* open udp socket */
+	in.s_addr = htonl(key >> 16);
+	inet_ntop(AF_INET, &in, ip, sizeof(ip));
+	p->udp_ctx = udp_open(ip, key & 0xffff);
 	if (!p->udp_ctx) {
-		printf("udp create failed!\n");
+		trace_err("udp create failed!");
 		return -1;
 	}
 	p->sock = p->udp_ctx->sock;
-
-	/* start thread */
-	rc = pthread_create(&thr, NULL, udp_program_thread, p);
-	if (rc) {
-		perror("pthread_create");
+	if (ts_ring_init(&p->ring)) {
+		udp_close(p->udp_ctx);
 		return -1;
 	}
-	p->thread = thr;
 	p->udp_addr = strdup(udp_addr);
 	pthread_mutex_init(&p->mutex, NULL);
-	p->refcnt = 1;
+	p->idle_start_time = time(NULL);
+	p->last_input_ms = ingest_now_ms();
+	p->stats.key = key;
+	p->shm = stats_shm_claim(key, &found);
+	if (found)
+		udp_program_restore(p);
+
+	/* hand the ring to an egress worker, the socket to a reactor */
+	egress_add_channel(p);
+	p->src.fd = p->sock;
+	p->src.on_input = udp_program_input;
+	p->src.on_tick = udp_program_tick;
+	p->src.data = p;
+	if (ingest_add(&p->src)) {
+		trace_err("udp program %s: no ingest reactor!", udp_addr);
+		egress_del_channel(p);
+		stats_shm_release(p->shm);
+		udp_close(p->udp_ctx);
+		ts_ring_destroy(&p->ring);
+		free(p->udp_addr);
+		p->udp_addr = NULL;
+		pthread_mutex_destroy(&p->mutex);
+		return -1;
+	}
+
+	__atomic_store_n(&p->key, key, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->refcnt, 2, __ATOMIC_RELEASE);
+	prog_hash_insert(p);
 
 	return 0;
 }
 
-static int udp_program_destroy(struct udp_program_entry *p)
+/*
+ * find the udp program of @udp_addr, start it if it is not running.
+ * returns it referenced, NULL if the address is bad or the table full.
+ */
+static struct udp_program_entry *open_udp_program(const char *udp_addr)
 {
+	struct udp_program_entry *p, *e;
+	uint64_t key;
+	int i;
+
+	key = udp_addr_key(udp_addr);
+	if (!key)
+		return NULL;
+	p = lookup_udp_program(key);
+	if (p)
+		return p;
+
 	pthread_mutex_lock(&prog_mutex);
-	if (p->refcnt > 1) {
+	p = lookup_udp_program(key);
+	if (!p) {
+		for (i = 0; (e = prog_slot(i)); i++) {
+			if (!e->udp_addr)
+				break;
+		}
+		if (!e)
+			e = prog_slab_grow();
+		if (e && !udp_program_init(e, udp_addr, key))
+			p = e;
+	}
+	pthread_mutex_unlock(&prog_mutex);
+
+	return p;
+}
+
+/*
+ * called from the reactor tick with the reactor locked, while a
+ * creator may hold prog_mutex and wait in ingest_add() for that
+ * reactor. so only try the lock, the next tick comes soon enough.
+ */
+static int udp_program_destroy(struct udp_program_entry *p)
+{
+	int i, ref = 1;
+
+	if (pthread_mutex_trylock(&prog_mutex))
+		return 0;
+	/* only the reactor's reference left, and nobody gets another */
+	if (!__atomic_compare_exchange_n(&p->refcnt, &ref, 0, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
 		pthread_mutex_unlock(&prog_mutex);
 		return 0;
 	}
+	/*
+	 * a handler may have added a stream or user and dropped its
+	 * reference since the tick saw the channel idle. nothing new
+	 * comes in at refcnt 0, so one look under the mutex settles it.
+	 */
+	pthread_mutex_lock(&p->mutex);
+	if (p->nr_streams > 0 || p->nr_users > 0) {
+		pthread_mutex_unlock(&p->mutex);
+		__atomic_store_n(&p->refcnt, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&prog_mutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&p->mutex);
+	prog_hash_delete(p);
+	__atomic_store_n(&p->key, 0, __ATOMIC_RELAXED);
+
+	/* leave the segment slot as of now for the next run */
+	if (p->shm) {
+		udp_program_publish_stats(p, ingest_now_ms());
+		stats_shm_release(p->shm);
+	}
 
+	egress_del_channel(p);
 	udp_close(p->udp_ctx);
+	for (i = 0; i < UDP_BATCH_MAX; i++) {
+		if (p->spare[i])
+			pktbuf_put(p->spare[i]);
+	}
+	ts_ring_destroy(&p->ring);
+	for (i = 0; i < RATE_LEVELS; i++)
+		ss_doc_put(p->ss_cache[i]);
 	free(p->udp_addr);
 	pthread_mutex_destroy(&p->mutex);
-	memset(p, 0, sizeof(*p));
+	/* free for the next channel, udp_program_reset() clears the rest */
+	p->udp_addr = NULL;
 	pthread_mutex_unlock(&prog_mutex);
 
 	return 1;
@@ -343,10 +875,10 @@ static int udp_program_destroy(struct udp_program_entry *p)
 void stream_page_handler(struct mg_connection *conn,
 			const struct mg_request_info *ri, void *data)
 {
-	mg_printf(conn, "%s", vlc_http_standard_reply);
+	mg_out_printf(conn, "%s", vlc_http_standard_reply);
 	struct udp_program_entry *udp_prog;
 	struct http_stream *http_stream = NULL;
-	int rc;
+	int sock;
 	char *udp_addr;
 
 	/*
@@ -354,36 +886,38 @@ void stream_page_handler(struct mg_connection *conn,
 	 */
 	udp_addr = mg_get_var(conn, "udp");
 	if (udp_addr)
-		printf("program udp address: %s\n", udp_addr);
+		trace_info("program udp address: %s", udp_addr);
 	else {
-		printf("no udp address provide!\n");
+		trace_warn("no udp address provide!");
 		return;
 	}
 
 	/*
 	 * find/create udp_program_entry
 	 */
-	udp_prog = get_udp_program(udp_addr);
+	udp_prog = open_udp_program(udp_addr);
 	if (!udp_prog) {
-		udp_prog = get_free_udp_program();
-		rc = udp_program_init(udp_prog, udp_addr);
-		if (rc) {
-			put_free_udp_program(udp_prog);
-			printf("udp_program init failed!\n");
-			return;
-		}
+		trace_err("udp_program init failed!");
+		return;
 	}
 
 	/*
-	 * put this http connection to udp_program_entry and playing
+	 * put this http connection to udp_program_entry and playing.
+	 * the socket goes to the egress engine, this worker is done.
 	 */
-	http_stream = add_http_stream(udp_prog, conn, ri);
+	mg_set_non_blocking_mode(conn);
+	sock = mg_detach_socket(conn);
+	if (sock < 0) {
+		put_udp_program(udp_prog);
+		return;
+	}
+	http_stream = add_http_stream(udp_prog, sock,
+		ri->remote_ip, ri->remote_port);
 	put_udp_program(udp_prog);
-	if (http_stream) {
-		while (http_stream->status == HTTP_STREAM_STATUS_RUNNING) {
-			sleep(1);
-		}
-		printf("http connection %d:%d done\n", ri->remote_ip, ri->remote_port);
+	if (!http_stream) {
+		trace_warn("udp program %s full or no egress, drop http connection %ld:%d",
+			udp_addr, ri->remote_ip, ri->remote_port);
+		close(sock);
 	}
 }
 
@@ -394,165 +928,352 @@ static const char *standard_reply = "HTTP/1.1 200 OK\r\n"
 void stream_info_handler(struct mg_connection *conn,
                    const struct mg_request_info *ri, void *data)
 {
-	int i, j;
-	char remote[64];
+	int i, j, n;
+	char addr[32], remote[64], tbuf[32];
 	struct in_addr inaddr;
-	struct udp_program_entry *p;
-	struct http_stream *s;
-
-	mg_printf(conn, "%s", standard_reply);
-	mg_printf(conn, "<html><body>");
-
-	mg_printf(conn, "<h2>rtvd version %s, support %d udp, %d http per udp</h2><hr>",
-		RTVD_VERSION, MAX_UDP_PROGRAM, MAX_HTTP_STREAM);
-	mg_printf(conn, "<p>stream information:</p>");
-	mg_printf(conn, "<table border=\"1\"><tr><th>udp stream</th><th>slot number</th><th>http client</th><th>send/discard bytes</th><th>start time</th></tr>");
-	for (i = 0; i < MAX_UDP_PROGRAM; i++) {
-		p = &udp_program_table[i];
-		for (j = 0; j <= udp_program_table[i].max_stream_index; j++) {
-			s = &p->streams[j];
-			if (s->conn) {
-				inaddr.s_addr = htonl(s->ri->remote_ip);
-				sprintf(remote, "%s:%d", inet_ntoa(inaddr),
-					s->ri->remote_port);
-				mg_printf(conn, "<tr><td>%s</td><td>%d</td><td>%s</td><td>%d/%d</td><td>%s</td></tr>",
-					p->udp_addr, j, remote, s->send_bytes, s->discard_bytes, ctime(&s->start_time));
-			}
+	struct chan_stats *cs;
+	struct client_stats *clients, *c;
+	struct mg_accept_stats as;
+	time_t start;
+
+	/* consistent snapshots, not the live counters */
+	cs = mg_arena_alloc(conn, sizeof(*cs));
+	clients = mg_arena_alloc(conn, stream_max_streams() * sizeof(*clients));
+	if (!cs || !clients)
+		return;
+
+	mg_out_printf(conn, "%s", standard_reply);
+	mg_out_printf(conn, "<html><body>");
+
+	mg_out_printf(conn, "<h2>rtvd version %s, support %d udp, %d http per udp</h2><hr>",
+		RTVD_VERSION, prog_limit, stream_limit);
+
+	mg_get_accept_stats(conn, &as);
+	mg_out_printf(conn, "<p>accept queue: %u listeners, depth %u/%u (max %u), "
+		"accepted %llu, full %llu, wait avg/max %llu/%llu us</p>",
+		as.num_shards, as.queue_depth, as.queue_size, as.max_depth,
+		as.accepted,
+		as.full_waits,
+		as.accepted ? as.wait_us_total / as.accepted : 0,
+		as.wait_us_max);
+	mg_out_printf(conn, "<p>stream information:</p>");
+	mg_out_printf(conn, "<table border=\"1\"><tr><th>udp stream</th><th>slot number</th><th>http client</th><th>send/discard bytes</th><th>start time</th></tr>");
+	for (i = 0; i < stream_nr_slots(); i++) {
+		n = stream_get_stats(i, cs, clients);
+		if (n <= 0)
+			continue;
+		stream_addr_str(cs->key, addr, sizeof(addr));
+		for (j = 0; j < n; j++) {
+			c = &clients[j];
+			inaddr.s_addr = htonl(c->ip);
+			sprintf(remote, "%s:%d", inet_ntoa(inaddr), c->port);
+			start = c->start_time;
+			mg_out_printf(conn, "<tr><td>%s</td><td>%d</td><td>%s</td><td>%llu/%llu</td><td>%s</td></tr>",
+				addr, c->slot, remote,
+				(unsigned long long)c->send_bytes,
+				(unsigned long long)c->discard_bytes,
+				ctime_r(&start, tbuf));
 		}
 	}
-	mg_printf(conn, "</table>");
-
-	int off = 0;
-	char pid_info[1024];
-	mg_printf(conn, "<p>pid information:</p>");
-	mg_printf(conn,
-		"<table border=\"1\"><tr><th>udp stream</th><th>pid</th></tr>");
-	for (i = 0; i < MAX_UDP_PROGRAM; i++) {
-		p = &udp_program_table[i];
-		if (p->nr_streams) {
-			for (j = 0; j <= 0x1FFF; j++) {
-				if (p->pid_table[j].count) {
-					off += sprintf(pid_info + off, "%d:%d ",
-						j,
-						p->pid_table[j].count);
-				}
-			}
-			mg_printf(conn, "<tr><td>%s</td><td>%s</td></tr>",
-				p->udp_addr, pid_info);
+	mg_out_printf(conn, "</table>");
+
+	int off;
+	char pid_info[1024], cc_info[1024];
+	struct pid_stats *ps;
+	mg_out_printf(conn, "<p>pid information:</p>");
+	mg_out_printf(conn,
+		"<table border=\"1\"><tr><th>udp stream</th><th>pid</th><th>cc errors</th><th>sync lost/skipped bytes</th><th>stalls/stall ms/null datagrams</th></tr>");
+	for (i = 0; i < stream_nr_slots(); i++) {
+		n = stream_get_stats(i, cs, NULL);
+		if (n <= 0)
+			continue;
+		stream_addr_str(cs->key, addr, sizeof(addr));
+		pid_info[0] = cc_info[0] = '\0';
+		for (j = 0, off = 0; j < (int)cs->nr_pids; j++) {
+			ps = &cs->pids[j];
+			if (off < (int)sizeof(pid_info))
+				off += snprintf(pid_info + off, sizeof(pid_info) - off,
+					"%d:%llu ", ps->pid, (unsigned long long)ps->count);
+		}
+		for (j = 0, off = 0; j < (int)cs->nr_pids; j++) {
+			ps = &cs->pids[j];
+			if (ps->cc_errors && off < (int)sizeof(cc_info))
+				off += snprintf(cc_info + off, sizeof(cc_info) - off,
+					"%d:%u ", ps->pid, ps->cc_errors);
 		}
+		mg_out_printf(conn, "<tr><td>%s</td><td>%s</td><td>%s</td><td>%u/%u</td><td>%u/%llu/%llu</td></tr>",
+			addr, pid_info, cc_info,
+			cs->sync_resyncs, cs->sync_skipped,
+			cs->stalls, (unsigned long long)cs->stall_ms,
+			(unsigned long long)cs->null_dgrams);
 	}
-	mg_printf(conn, "</table>");
+	mg_out_printf(conn, "</table>");
 
-	mg_printf(conn, "</body></html>");
+	mg_out_printf(conn, "</body></html>");
 }
 
 static const char *svg_standard_reply = "HTTP/1.1 200 OK\r\n"
 "Content-Type: text/xml\r\n"
 "Connection: close\r\n\n";
 
-void stream_static_handler(struct mg_connection *conn,
-                   const struct mg_request_info *ri, void *data)
+/*
+ * /ss document of a channel, rendered at most once a second and shared
+ * by every viewer of that second
+ */
+struct ss_doc {
+	int refcnt;
+	time_t time;
+	size_t len, size;
+	char data[];
+};
+
+/* room for the document of @nr pids with @bars bars each */
+#define SS_HEAD_BYTES		512
+#define SS_PID_BYTES		384	/* label, timeline and average */
+#define SS_BAR_BYTES		192	/* the two rects of a tall bar */
+#define SS_DOC_SIZE(nr, bars) \
+	(SS_HEAD_BYTES + (size_t)(nr) * (SS_PID_BYTES + (bars) * SS_BAR_BYTES))
+
+static void ss_doc_put(struct ss_doc *d)
 {
-	static char sbuf[1024 * 40];
-	struct udp_program_entry *p = NULL;
-	int his_idx, y = 60, off = 0, pid;
-	int rate_index;
-	time_t base_time;
-	char *udp_addr;
+	if (d && __atomic_sub_fetch(&d->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		free(d);
+}
 
-	/*
-	 * which udp program entry to check
-	 */
-	udp_addr = mg_get_var(conn, "udp");
-	if (udp_addr) {
-		p = get_udp_program(udp_addr);
-	}
-	if (!p)
-		p = get_first_udp_program();
-	if (!p)
-		return;
+/*
+ * the renderer streams each fragment to the client and keeps a copy
+ * for the cache, a copy that does not fit is given up
+ */
+struct ss_writer {
+	struct mg_connection *conn;
+	struct ss_doc *doc;
+};
 
-	rate_index = p->rate_index;
-	base_time = time(NULL) - rate_index;
+static void ss_printf(struct ss_writer *w, const char *fmt, ...)
+{
+	char buf[256], *frag = buf;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	/* a long one, format it again where it fits */
+	if (n >= (int)sizeof(buf)) {
+		frag = mg_arena_alloc(w->conn, n + 1);
+		if (!frag)
+			return;
+		va_start(ap, fmt);
+		vsnprintf(frag, n + 1, fmt, ap);
+		va_end(ap);
+	}
+	mg_out_write(w->conn, frag, n);
 
-	if (rate_index <= 2) {
-		put_udp_program(p);
+	if (!w->doc)
+		return;
+	if (w->doc->len + n > w->doc->size) {
+		free(w->doc);
+		w->doc = NULL;
 		return;
 	}
+	memcpy(w->doc->data + w->doc->len, frag, n);
+	w->doc->len += n;
+}
 
-	mg_printf(conn, "%s", svg_standard_reply);
+/*
+ * pid @i of the last channel snapshot with a copy of its rate history,
+ * -1 past the snapshot's pids
+ */
+static int ss_snapshot_pid(struct udp_program_entry *p, int i,
+		struct rate_history *rate)
+{
+	unsigned int seq;
+	int pid;
+
+	do {
+		seq = seq_read_begin(&p->stats_seq);
+		pid = -1;
+		if (i < (int)MIN(p->stats.nr_pids, MAX_ACTIVE_PID)) {
+			pid = p->stats.pids[i].pid;
+			*rate = p->rates[i];
+		}
+	} while (seq_read_retry(&p->stats_seq, seq));
 
-	off += sprintf(sbuf + off,
+	return pid;
+}
+
+/*
+ * the current page of level @l: the complete buckets since the ring
+ * last wrapped, one bar each, for at most @nr pids. the histories are
+ * copied out of the snapshot one pid at a time.
+ */
+static void ss_render(struct ss_writer *w, struct udp_program_entry *p,
+		int nr, int l, uint32_t rate_epoch, time_t base_time)
+{
+	const struct rate_level *lv = &rate_levels[l];
+	uint32_t cur = rate_epoch / lv->secs;
+	int page = cur % lv->slots;
+	int his_idx, y = 60, pid, i;
+	struct rate_history rate;
+	char tbuf[32];
+
+	ss_printf(w,
 		"<?xml version=\"1.0\" encoding=\"utf-8\"?>"
 		"<!DOCTYPE svg>"
 		"<svg width=\"800px\" height=\"600px\" xmlns=\"http://www.w3.org/2000/svg\"><g>");
 
-	off += sprintf(sbuf + off,
+	ss_printf(w,
 		"<text font-size=\"16\" x=\"10\" y=\"20\">base time: %s</text>",
-		ctime(&base_time));
-	for (pid = 0; pid <= 0x1FFF; pid++) {
-		if (!p->pid_table[pid].count)
-			continue;
+		ctime_r(&base_time, tbuf));
+	for (i = 0; i < nr && (pid = ss_snapshot_pid(p, i, &rate)) >= 0; i++) {
 
 		/* pid and timeline */
-		off += sprintf(sbuf + off,
+		ss_printf(w,
 			"<text font-size=\"16\" x=\"5\" y=\"%d\">%d</text>",
 			y - 2, pid);
-		off += sprintf(sbuf + off,
+		ss_printf(w,
 			"<rect x=\"40\" y=\"%d\" width=\"600\" height=\"2\" style=\"fill:#00ff00\" />",
 			y);
 
 		int x = 50;
-		uint32_t rate_sum = 0;
-		for (his_idx = 0; his_idx < rate_index; his_idx++) {
-			int r = p->pid_table[pid].rate_history[his_idx];
-			rate_sum += r;
+		uint64_t rate_sum = 0;
+		for (his_idx = 0; his_idx < page; his_idx++) {
+			uint32_t c = rate_get(&rate, l, cur - page + his_idx);
+			/* packets per second, whatever the bucket width */
+			int r = c / lv->secs;
+			rate_sum += c;
 			if (r >= 60) {
 				int z = r / 60;
 				char *z_style = "style=\"fill:#880000\"";
 				if (z >= 60)
 					z_style = "style=\"fill:#FF0000\"";
-				off += sprintf(sbuf + off,
+				ss_printf(w,
 					"<rect x=\"%d\" y=\"%d\" width=\"3\" height=\"%d\" style=\"fill:#AAAAAA\" />",
 					x, y -  r % 60, r % 60);
-				off += sprintf(sbuf + off,
+				ss_printf(w,
 				"<rect x=\"%d\" y=\"%d\" width=\"1\" height=\"%d\" %s />",
 					x + 1, y -  z % 60, z % 60, z_style);
 			} else {
-				off += sprintf(sbuf + off,
+				ss_printf(w,
 					"<rect x=\"%d\" y=\"%d\" width=\"3\" height=\"%d\" />",
 					x, y - r, r);
 			}
 			x += 5;
 		}
-		uint32_t rate_avg = rate_sum / rate_index;
-		off += sprintf(sbuf + off,
-			"<text font-size=\"16\" x=\"%d\" y=\"%d\">avg=%d bps</text>",
-			50 + (5 * MAX_RATE_SEC), y - 2, rate_avg * 188 * 8);
+		uint64_t avg = rate_sum / ((uint64_t)page * lv->secs);
+		ss_printf(w,
+			"<text font-size=\"16\" x=\"%d\" y=\"%d\">avg=%llu bps</text>",
+			50 + (5 * MAX_RATE_SEC), y - 2,
+			(unsigned long long)avg * TS_PKT_SIZE * 8);
 
 		y += 60 + 10;
 	}
 
-	put_udp_program(p);
+	ss_printf(w, "</g></svg>");
+}
 
-	off += sprintf(sbuf + off, "</g></svg>");
+/*
+ * /ss?udp=a.b.c.d:port&res=1s|10s|1m|1h, 1s by default
+ */
+void stream_static_handler(struct mg_connection *conn,
+                   const struct mg_request_info *ri, void *data)
+{
+	struct udp_program_entry *p = NULL;
+	struct ss_writer w;
+	struct ss_doc *d, *old;
+	uint32_t rate_epoch, cur;
+	time_t now, base_time;
+	const char *qs = ri->query_string;
+	char *udp_addr, res[8];
+	int l = 0, page, nr;
+
+	mg_get_var_3(qs, qs ? strlen(qs) : 0, "res", res, sizeof(res));
+	if (res[0] && (l = rate_level_by_name(res)) < 0)
+		return;
+
+	/*
+	 * which udp program entry to check
+	 */
+	udp_addr = mg_get_var(conn, "udp");
+	if (udp_addr) {
+		p = get_udp_program(udp_addr);
+	}
+	if (!p)
+		p = get_first_udp_program();
+	if (!p)
+		return;
+
+	/* the histories snapshotted below are at least this far on */
+	rate_epoch = __atomic_load_n(&p->stats.epoch, __ATOMIC_ACQUIRE);
+	cur = rate_epoch / rate_levels[l].secs;
+	page = cur % rate_levels[l].slots;
+	if (page <= (l ? 0 : 2)) {
+		put_udp_program(p);
+		return;
+	}
+
+	mg_out_printf(conn, "%s", svg_standard_reply);
+
+	/* somebody rendered it this second */
+	now = time(NULL);
+	pthread_mutex_lock(&p->mutex);
+	d = p->ss_cache[l];
+	if (d && d->time == now)
+		__atomic_add_fetch(&d->refcnt, 1, __ATOMIC_RELAXED);
+	else
+		d = NULL;
+	pthread_mutex_unlock(&p->mutex);
+	if (d) {
+		put_udp_program(p);
+		mg_out_write(conn, d->data, d->len);
+		ss_doc_put(d);
+		return;
+	}
 
-	mg_write(conn, sbuf, off);
+	/* no more pids than the document was sized for */
+	nr = MIN(__atomic_load_n(&p->stats.nr_pids, __ATOMIC_RELAXED),
+		 MAX_ACTIVE_PID);
+
+	w.conn = conn;
+	w.doc = malloc(sizeof(*w.doc) + SS_DOC_SIZE(nr, page));
+	if (w.doc) {
+		w.doc->refcnt = 1;
+		w.doc->time = now;
+		w.doc->len = 0;
+		w.doc->size = SS_DOC_SIZE(nr, page);
+	}
+	base_time = now - (rate_epoch - (cur - page) * rate_levels[l].secs);
+	ss_render(&w, p, nr, l, rate_epoch, base_time);
+
+	/* keep it unless a newer one made it first */
+	if (w.doc) {
+		pthread_mutex_lock(&p->mutex);
+		old = p->ss_cache[l];
+		if (!old || old->time <= now) {
+			p->ss_cache[l] = w.doc;
+			w.doc = old;
+		}
+		pthread_mutex_unlock(&p->mutex);
+		ss_doc_put(w.doc);
+	}
+	put_udp_program(p);
 }
 
 void stream_pcr_handler(struct mg_connection *conn,
 						const struct mg_request_info *ri, void *data)
 {
-	mg_printf(conn, "%s", standard_reply);
-	mg_printf(conn, "<html><head>");
-	mg_printf(conn, "<script src=\"js/jquery.js\"></script>");
-	mg_printf(conn, "<script src=\"js/pcr.js\"></script>");
-	mg_printf(conn, "</head><body>");
-	mg_printf(conn, "<div id=\"flipboard\"></div>");
-	mg_printf(conn, "<div id=\"error\"></div>");
-	mg_printf(conn, "<p>UDP:<input id=\"udp\" value=\"127.0.0.1:1234\" />");
-	mg_printf(conn, "<button id=\"ss_button\">Start</button>");
-	mg_printf(conn, "</body></html>");
+	mg_out_printf(conn, "%s", standard_reply);
+	mg_out_printf(conn, "<html><head>");
+	mg_out_printf(conn, "<script src=\"js/jquery.js\"></script>");
+	mg_out_printf(conn, "<script src=\"js/pcr.js\"></script>");
+	mg_out_printf(conn, "</head><body>");
+	mg_out_printf(conn, "<div id=\"flipboard\"></div>");
+	mg_out_printf(conn, "<div id=\"error\"></div>");
+	mg_out_printf(conn, "<p>UDP:<input id=\"udp\" value=\"127.0.0.1:1234\" />");
+	mg_out_printf(conn, "<button id=\"ss_button\">Start</button>");
+	mg_out_printf(conn, "</body></html>");
 }
 
 static const char *ajax_reply_start =
@@ -578,7 +1299,7 @@ static int handle_jsonp(struct mg_connection *conn,
 
 	get_qsvar(request_info, "callback", cb, sizeof(cb));
 	if (cb[0] != '\0') {
-		mg_printf(conn, "%s(", cb);
+		mg_out_printf(conn, "%s(", cb);
 	}
 
 	return cb[0] == '\0' ? 0 : 1;
@@ -592,27 +1313,21 @@ void stream_start_flow_handler(struct mg_connection *conn,
 	struct udp_program_entry *udp_prog;
 
 	/* response header */
-	mg_printf(conn, "%s", ajax_reply_start);
+	mg_out_printf(conn, "%s", ajax_reply_start);
 	is_jsonp = handle_jsonp(conn, ri);
 
 	/* start udp program if needed */
 	get_qsvar(ri, "udp", udp, sizeof(udp));
-	udp_prog = get_udp_program(udp);
-	if (!udp_prog) {
-		udp_prog = get_free_udp_program();
-		int rc = udp_program_init(udp_prog, udp);
-		if (rc) {
-			put_free_udp_program(udp_prog);
-			goto error_out;
-		}
-	}
+	udp_prog = open_udp_program(udp);
+	if (!udp_prog)
+		goto error_out;
 	inc_udp_program_user(udp_prog);
 	put_udp_program(udp_prog);
 
 error_out:
 	/* response tail */
 	if (is_jsonp) {
-		mg_printf(conn, "%s", ")");
+		mg_out_printf(conn, "%s", ")");
 	}
 }
 
@@ -624,7 +1339,7 @@ void stream_stop_flow_handler(struct mg_connection *conn,
 	struct udp_program_entry *udp_prog;
 
 	/* response header */
-	mg_printf(conn, "%s", ajax_reply_start);
+	mg_out_printf(conn, "%s", ajax_reply_start);
 	is_jsonp = handle_jsonp(conn, ri);
 
 	/* check udp program presened and stop it */
@@ -637,7 +1352,7 @@ void stream_stop_flow_handler(struct mg_connection *conn,
 
 	/* response tail */
 	if (is_jsonp) {
-		mg_printf(conn, "%s", ")");
+		mg_out_printf(conn, "%s", ")");
 	}
 }
 
@@ -0,0 +1,401 @@
+/*
+ * mpeg-ts header scanner
+ *
+ * every kernel walks the buffer in 188 byte strides, reads the 4 byte
+ * header of each packet and packs it as
+ *
+ *	pid | cc << 16 | flags << 24
+ *
+ * which is the little endian layout of struct ts_hdr. when a stride does
+ * not land on a sync byte the kernel looks for the next offset where
+ * both that byte and the one a packet later are 0x47, and carries on
+ * from there.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ts.h"
+#include "message.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TS_HAVE_X86
+#include <immintrin.h>
+#endif
+
+
+static msgobj mo = {
+	MSG_INFO,
+	1,
+	"ts",
+};
+
+/*
+ * @h holds the 4 header bytes, first byte lowest
+ */
+static inline uint32_t ts_hdr_word(uint32_t h)
+{
+	uint32_t pid = (h & 0x1F00) | ((h >> 16) & 0xFF);
+	uint32_t cc = (h >> 24) & 0x0F;
+	uint32_t flags = ((h >> 14) & TS_F_PUSI) |
+		((h >> 28) & TS_F_AF) |
+		((h >> 26) & TS_F_PAYLOAD) |
+		((h >> 12) & TS_F_TEI);
+
+	return pid | cc << 16 | flags << 24;
+}
+
+static inline void ts_hdr_set(struct ts_hdr *hdr, uint32_t w)
+{
+	hdr->pid = w & 0xFFFF;
+	hdr->cc = (w >> 16) & 0xFF;
+	hdr->flags = w >> 24;
+}
+
+static inline uint32_t ts_load_hdr(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int ts_resync_scalar(const unsigned char *buf, int off, int len)
+{
+	for (; off < len; off++) {
+		if (buf[off] != TS_SYNC_BYTE)
+			continue;
+		if (off + TS_PKT_SIZE >= len || buf[off + TS_PKT_SIZE] == TS_SYNC_BYTE)
+			return off;
+	}
+
+	return len;
+}
+
+/*
+ * lost sync at @off, move on to the next packet start
+ */
+static inline int ts_skip(const unsigned char *buf, int off, int len,
+		int (*resync)(const unsigned char *, int, int),
+		struct ts_scan_stats *st)
+{
+	int next = resync(buf, off + 1, len);
+
+	if (st) {
+		st->skipped += next - off;
+		st->resyncs++;
+	}
+
+	return next;
+}
+
+static inline void ts_tail(int off, int len, struct ts_scan_stats *st)
+{
+	if (st && off < len)
+		st->skipped += len - off;
+}
+
+static int ts_scan_scalar(const unsigned char *buf, int len,
+		struct ts_hdr *hdr, int max, struct ts_scan_stats *st)
+{
+	int off = 0, n = 0;
+
+	while (n < max && off + TS_PKT_SIZE <= len) {
+		if (buf[off] != TS_SYNC_BYTE) {
+			off = ts_skip(buf, off, len, ts_resync_scalar, st);
+			continue;
+		}
+		ts_hdr_set(&hdr[n++], ts_hdr_word(ts_load_hdr(buf + off)));
+		off += TS_PKT_SIZE;
+	}
+	if (n < max)
+		ts_tail(off, len, st);
+
+	return n;
+}
+
+#ifdef TS_HAVE_X86
+
+/* x86 is little endian, the header bytes load as one word */
+static inline uint32_t ts_load32(const unsigned char *p)
+{
+	uint32_t h;
+
+	memcpy(&h, p, sizeof(h));
+	return h;
+}
+
+__attribute__((target("sse2")))
+static int ts_resync_sse2(const unsigned char *buf, int off, int len)
+{
+	const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+	__m128i a, b;
+	int m;
+
+	while (off + TS_PKT_SIZE + 16 <= len) {
+		a = _mm_loadu_si128((const __m128i *)(buf + off));
+		b = _mm_loadu_si128((const __m128i *)(buf + off + TS_PKT_SIZE));
+		m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, sync),
+				_mm_cmpeq_epi8(b, sync)));
+		if (m)
+			return off + __builtin_ctz(m);
+		off += 16;
+	}
+
+	return ts_resync_scalar(buf, off, len);
+}
+
+/*
+ * header words of 4 lanes at once, lanes past the buffer are zero
+ */
+__attribute__((target("sse2")))
+static inline __m128i ts_hdr_word_sse2(__m128i h)
+{
+	const __m128i m_1f00 = _mm_set1_epi32(0x1F00);
+	const __m128i m_ff = _mm_set1_epi32(0xFF);
+	const __m128i m_0f = _mm_set1_epi32(0x0F);
+	__m128i pid, cc, flags;
+
+	pid = _mm_or_si128(_mm_and_si128(h, m_1f00),
+		_mm_and_si128(_mm_srli_epi32(h, 16), m_ff));
+	cc = _mm_and_si128(_mm_srli_epi32(h, 24), m_0f);
+	flags = _mm_or_si128(
+		_mm_or_si128(
+			_mm_and_si128(_mm_srli_epi32(h, 14), _mm_set1_epi32(TS_F_PUSI)),
+			_mm_and_si128(_mm_srli_epi32(h, 28), _mm_set1_epi32(TS_F_AF))),
+		_mm_or_si128(
+			_mm_and_si128(_mm_srli_epi32(h, 26), _mm_set1_epi32(TS_F_PAYLOAD)),
+			_mm_and_si128(_mm_srli_epi32(h, 12), _mm_set1_epi32(TS_F_TEI))));
+
+	return _mm_or_si128(pid, _mm_or_si128(_mm_slli_epi32(cc, 16),
+			_mm_slli_epi32(flags, 24)));
+}
+
+__attribute__((target("sse2")))
+static int ts_scan_sse2(const unsigned char *buf, int len,
+		struct ts_hdr *hdr, int max, struct ts_scan_stats *st)
+{
+	const __m128i sync = _mm_set1_epi32(TS_SYNC_BYTE);
+	const __m128i m_ff = _mm_set1_epi32(0xFF);
+	uint32_t out[4];
+	int off = 0, n = 0, cnt, good, ok;
+	__m128i h;
+
+	while (n < max && off + TS_PKT_SIZE <= len) {
+		cnt = (len - off) / TS_PKT_SIZE;
+		if (cnt > 4)
+			cnt = 4;
+		if (cnt > max - n)
+			cnt = max - n;
+		h = _mm_setr_epi32(ts_load32(buf + off),
+			cnt > 1 ? ts_load32(buf + off + TS_PKT_SIZE) : 0,
+			cnt > 2 ? ts_load32(buf + off + 2 * TS_PKT_SIZE) : 0,
+			cnt > 3 ? ts_load32(buf + off + 3 * TS_PKT_SIZE) : 0);
+
+		ok = _mm_movemask_ps(_mm_castsi128_ps(
+			_mm_cmpeq_epi32(_mm_and_si128(h, m_ff), sync)));
+		good = __builtin_ctz(~ok | (1 << cnt));
+		if (good == 4) {
+			_mm_storeu_si128((__m128i *)&hdr[n], ts_hdr_word_sse2(h));
+		} else if (good) {
+			/* unrolled, a variable length memcpy costs more than the scan */
+			_mm_storeu_si128((__m128i *)out, ts_hdr_word_sse2(h));
+			switch (good) {
+			case 3:
+				memcpy(&hdr[n + 2], &out[2], sizeof(*hdr));
+				/* fall through */
+			case 2:
+				memcpy(&hdr[n + 1], &out[1], sizeof(*hdr));
+				/* fall through */
+			default:
+				memcpy(&hdr[n], &out[0], sizeof(*hdr));
+			}
+		}
+		n += good;
+		off += good * TS_PKT_SIZE;
+		if (good < cnt)
+			off = ts_skip(buf, off, len, ts_resync_sse2, st);
+	}
+	if (n < max)
+		ts_tail(off, len, st);
+
+	return n;
+}
+
+__attribute__((target("avx2")))
+static int ts_resync_avx2(const unsigned char *buf, int off, int len)
+{
+	const __m256i sync = _mm256_set1_epi8(TS_SYNC_BYTE);
+	__m256i a, b;
+	unsigned int m;
+
+	while (off + TS_PKT_SIZE + 32 <= len) {
+		a = _mm256_loadu_si256((const __m256i *)(buf + off));
+		b = _mm256_loadu_si256((const __m256i *)(buf + off + TS_PKT_SIZE));
+		m = _mm256_movemask_epi8(_mm256_and_si256(
+				_mm256_cmpeq_epi8(a, sync),
+				_mm256_cmpeq_epi8(b, sync)));
+		if (m)
+			return off + __builtin_ctz(m);
+		off += 32;
+	}
+
+	return ts_resync_sse2(buf, off, len);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ts_hdr_word_avx2(__m256i h)
+{
+	const __m256i m_1f00 = _mm256_set1_epi32(0x1F00);
+	const __m256i m_ff = _mm256_set1_epi32(0xFF);
+	const __m256i m_0f = _mm256_set1_epi32(0x0F);
+	__m256i pid, cc, flags;
+
+	pid = _mm256_or_si256(_mm256_and_si256(h, m_1f00),
+		_mm256_and_si256(_mm256_srli_epi32(h, 16), m_ff));
+	cc = _mm256_and_si256(_mm256_srli_epi32(h, 24), m_0f);
+	flags = _mm256_or_si256(
+		_mm256_or_si256(
+			_mm256_and_si256(_mm256_srli_epi32(h, 14),
+				_mm256_set1_epi32(TS_F_PUSI)),
+			_mm256_and_si256(_mm256_srli_epi32(h, 28),
+				_mm256_set1_epi32(TS_F_AF))),
+		_mm256_or_si256(
+			_mm256_and_si256(_mm256_srli_epi32(h, 26),
+				_mm256_set1_epi32(TS_F_PAYLOAD)),
+			_mm256_and_si256(_mm256_srli_epi32(h, 12),
+				_mm256_set1_epi32(TS_F_TEI))));
+
+	return _mm256_or_si256(pid, _mm256_or_si256(_mm256_slli_epi32(cc, 16),
+			_mm256_slli_epi32(flags, 24)));
+}
+
+/*
+ * 8 headers per gather, a whole datagram of 7 packets in one go
+ */
+__attribute__((target("avx2")))
+static int ts_scan_avx2(const unsigned char *buf, int len,
+		struct ts_hdr *hdr, int max, struct ts_scan_stats *st)
+{
+	const __m256i stride = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i index = _mm256_mullo_epi32(stride,
+		_mm256_set1_epi32(TS_PKT_SIZE));
+	const __m256i sync = _mm256_set1_epi32(TS_SYNC_BYTE);
+	const __m256i m_ff = _mm256_set1_epi32(0xFF);
+	int off = 0, n = 0, cnt, good, ok;
+	__m256i h, mask;
+
+	while (n < max && off + TS_PKT_SIZE <= len) {
+		cnt = (len - off) / TS_PKT_SIZE;
+		if (cnt > 8)
+			cnt = 8;
+		if (cnt > max - n)
+			cnt = max - n;
+		mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(cnt), stride);
+		h = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+			(const int *)(buf + off), index, mask, 1);
+
+		ok = _mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(_mm256_and_si256(h, m_ff), sync)));
+		good = __builtin_ctz(~ok | (1 << cnt));
+		if (good)
+			_mm256_maskstore_epi32((int *)&hdr[n],
+				_mm256_cmpgt_epi32(_mm256_set1_epi32(good), stride),
+				ts_hdr_word_avx2(h));
+		n += good;
+		off += good * TS_PKT_SIZE;
+		if (good < cnt)
+			off = ts_skip(buf, off, len, ts_resync_avx2, st);
+	}
+	if (n < max)
+		ts_tail(off, len, st);
+
+	return n;
+}
+
+static int ts_have_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int ts_have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif /* TS_HAVE_X86 */
+
+static int ts_have_scalar(void)
+{
+	return 1;
+}
+
+static const struct ts_impl {
+	const char *name;
+	ts_scan_fn scan;
+	int (*supported)(void);
+} ts_impls[] = {
+#ifdef TS_HAVE_X86
+	/*
+	 * fastest first, as bench/ts_bench measures them: the avx2
+	 * kernel loses its wider compare to the lane shuffles and runs
+	 * slower than sse2, it is kept for ts_set_impl()
+	 */
+	{ "sse2", ts_scan_sse2, ts_have_sse2 },
+	{ "avx2", ts_scan_avx2, ts_have_avx2 },
+#endif
+	{ "scalar", ts_scan_scalar, ts_have_scalar },
+	{ NULL, NULL, NULL },
+};
+
+static const struct ts_impl *ts_cur;
+
+/*
+ * pick the first kernel of ts_impls this cpu runs
+ */
+void ts_init(void)
+{
+	const struct ts_impl *impl;
+
+	for (impl = ts_impls; impl->name; impl++) {
+		if (impl->supported()) {
+			ts_cur = impl;
+			trace_info("header scanner: %s", impl->name);
+			return;
+		}
+	}
+}
+
+/*
+ * force a kernel by name, -1 if unknown or not supported here
+ */
+int ts_set_impl(const char *name)
+{
+	const struct ts_impl *impl;
+
+	for (impl = ts_impls; impl->name; impl++) {
+		if (!strcmp(impl->name, name)) {
+			if (!impl->supported())
+				return -1;
+			ts_cur = impl;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *ts_impl_name(void)
+{
+	if (!ts_cur)
+		ts_init();
+	return ts_cur->name;
+}
+
+int ts_scan(const unsigned char *buf, int len,
+		struct ts_hdr *hdr, int max, struct ts_scan_stats *st)
+{
+	if (!ts_cur)
+		ts_init();
+	return ts_cur->scan(buf, len, hdr, max, st);
+}
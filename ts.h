@@ -0,0 +1,53 @@
+#ifndef _TS_H_
+#define _TS_H_
+
+#include <stdint.h>
+
+
+/*
+ * mpeg-ts packet header scanner
+ *
+ * pulls pid, continuity counter and flag bits out of every packet of a
+ * buffer in one pass, resyncing on the 0x47 sync byte when the buffer
+ * does not start on a packet or has garbage in it. sse2 and avx2
+ * kernels are picked at runtime, with a scalar fallback.
+ */
+
+#define TS_PKT_SIZE		188
+#define TS_SYNC_BYTE		0x47
+#define TS_NULL_PID		0x1FFF
+
+/* ts_hdr.flags */
+#define TS_F_PUSI		0x01	/* payload unit start */
+#define TS_F_AF			0x02	/* adaptation field present */
+#define TS_F_PAYLOAD		0x04	/* payload present */
+#define TS_F_TEI		0x08	/* transport error */
+
+struct ts_hdr {
+	uint16_t pid;
+	uint8_t cc;
+	uint8_t flags;
+};
+
+struct ts_scan_stats {
+	int skipped;	/* bytes outside any packet */
+	int resyncs;	/* times sync was lost and found again */
+};
+
+typedef int (*ts_scan_fn)(const unsigned char *buf, int len,
+		struct ts_hdr *hdr, int max, struct ts_scan_stats *st);
+
+void ts_init(void);
+int ts_set_impl(const char *name);
+const char *ts_impl_name(void);
+
+/*
+ * parse up to @max packet headers of @buf into @hdr, return the number
+ * parsed. @st, if given, accumulates skipped bytes and resyncs.
+ */
+int ts_scan(const unsigned char *buf, int len,
+		struct ts_hdr *hdr, int max, struct ts_scan_stats *st);
+
+
+#endif /* _TS_H_ */
+
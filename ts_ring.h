@@ -0,0 +1,116 @@
+#ifndef _TS_RING_H_
+#define _TS_RING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pktbuf.h"
+
+
+/*
+ * single producer, multi consumer ring of udp datagrams (7 ts packets).
+ *
+ * the ingest reactor is the only writer. a slot holds a reference on
+ * its pktbuf until it is overwritten. each reader keeps its own
+ * sequence cursor and takes its own reference on the slot's buffer
+ * under a per slot sequence check, so a reader never blocks the writer,
+ * never copies, and a reader that falls more than one ring behind
+ * simply sees its slots overwritten.
+ */
+
+#define TS_RING_SLOTS		512	/* power of 2 */
+#define TS_RING_MASK		(TS_RING_SLOTS - 1)
+#define TS_RING_SEQ_INVALID	((uint64_t)-1)
+
+struct ts_ring_slot {
+	uint64_t seq;
+	struct pktbuf *buf;
+};
+
+struct ts_ring {
+	uint64_t head;		/* next sequence to be published */
+	struct ts_ring_slot *slots;
+};
+
+static inline uint64_t ts_ring_head(struct ts_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * producer: publish @b as the next sequence, the ring takes over the
+ * caller's reference.
+ */
+static inline void ts_ring_put(struct ts_ring *r, struct pktbuf *b)
+{
+	struct ts_ring_slot *slot = &r->slots[r->head & TS_RING_MASK];
+	struct pktbuf *old = slot->buf;
+
+	__atomic_store_n(&slot->seq, TS_RING_SEQ_INVALID, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->buf, b, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, r->head, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+
+	/* readers still sending it keep their own reference */
+	if (old)
+		pktbuf_put(old);
+}
+
+/*
+ * consumer: return slot @seq's buffer with a reference held,
+ * or NULL if it was overwritten already.
+ */
+static inline struct pktbuf *ts_ring_get(struct ts_ring *r, uint64_t seq)
+{
+	struct ts_ring_slot *slot = &r->slots[seq & TS_RING_MASK];
+	struct pktbuf *b;
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+		return NULL;
+	b = __atomic_load_n(&slot->buf, __ATOMIC_ACQUIRE);
+	if (!b || !pktbuf_tryget(b))
+		return NULL;
+	/* the buffer may have been recycled between the loads */
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+		pktbuf_put(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+static inline int ts_ring_init(struct ts_ring *r)
+{
+	int i;
+
+	r->head = 0;
+	r->slots = (struct ts_ring_slot *)
+		calloc(TS_RING_SLOTS, sizeof(struct ts_ring_slot));
+	if (!r->slots)
+		return -1;
+	for (i = 0; i < TS_RING_SLOTS; i++)
+		r->slots[i].seq = TS_RING_SEQ_INVALID;
+
+	return 0;
+}
+
+/*
+ * drop every slot's reference, readers must be gone
+ */
+static inline void ts_ring_destroy(struct ts_ring *r)
+{
+	int i;
+
+	if (!r->slots)
+		return;
+	for (i = 0; i < TS_RING_SLOTS; i++) {
+		if (r->slots[i].buf)
+			pktbuf_put(r->slots[i].buf);
+	}
+	free(r->slots);
+	r->slots = NULL;
+}
+
+#endif /* _TS_RING_H_ */
+
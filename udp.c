@@ -2,9 +2,12 @@
  * udp
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/uio.h>
@@ -32,6 +35,7 @@ struct udp_context * udp_open(char *ip, short port)
 
 	ctx = (struct udp_context *)malloc(sizeof(*ctx));
 	ctx->port = port;
+	ctx->drops = 0;
 	memset(&ctx->m_addr, 0, sizeof(ctx->m_addr));
 	memset(&ctx->m_imr, 0, sizeof(ctx->m_imr));
 
@@ -59,6 +63,12 @@ struct udp_context * udp_open(char *ip, short port)
 		return NULL;
 	}
 
+#ifdef SO_RXQ_OVFL
+	/* have the kernel report its drop count with every datagram */
+	dw = 1;
+	setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, (const char*)&dw, sizeof(dw));
+#endif
+
 	if (bind(sock, (struct sockaddr*)&ctx->m_addr, sizeof(struct sockaddr_in)) < 0) {
 		close(sock);
 		return NULL;
@@ -86,35 +96,63 @@ void udp_close(struct udp_context *ctx)
 	free(ctx);
 }
 
-int udp_read_data(struct udp_context *udp_ctx, void *buf, int size)
+/*
+ * read up to @n datagrams into the caller supplied @iov vector, one
+ * datagram per iovec, and store the length of each one in @lens.
+ * never blocks, only datagrams already queued on the socket are taken,
+ * so call it once the socket polled readable.
+ *
+ * return number of datagrams read, 0 if none queued, -1 on error.
+ */
+int udp_read_batch(struct udp_context *udp_ctx, struct iovec *iov,
+		int *lens, int n)
 {
 	int sock = udp_ctx->sock;
-	int from_addr_len = sizeof(struct sockaddr_in);
-	int len;
-	int rc;
-	struct timeval to;
-	fd_set read_set;
-
-	to.tv_sec = 1;
-	to.tv_usec = 0;
-	FD_ZERO(&read_set);
-	FD_SET(sock, &read_set);
-
-	rc = select(sock + 1, &read_set, NULL, NULL, &to);
-	if (rc > 0) {
-		len = recvfrom(sock, buf, size, 0,
-			(struct sockaddr *)&udp_ctx->m_addr, (socklen_t *)&from_addr_len);
-		return len;
-	} else if (rc == 0) {
-		// timeout
-		return 0;
-	} else {
-		// error
-		return -1;
+	int i, rc;
+
+	if (n > UDP_BATCH_MAX)
+		n = UDP_BATCH_MAX;
+
+#ifdef __linux__
+	struct mmsghdr msgs[UDP_BATCH_MAX];
+	char ctrl[UDP_BATCH_MAX][CMSG_SPACE(sizeof(uint32_t))];
+	struct cmsghdr *cmsg;
+
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+	for (i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = ctrl[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
 	}
+	rc = recvmmsg(sock, msgs, n, MSG_DONTWAIT, NULL);
+	if (rc < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	for (i = 0; i < rc; i++)
+		lens[i] = msgs[i].msg_len;
 
-	// can't reach here!
+	/* the drop count rides on every datagram, the last one is newest */
+	if (rc > 0) {
+		for (cmsg = CMSG_FIRSTHDR(&msgs[rc - 1].msg_hdr); cmsg;
+		     cmsg = CMSG_NXTHDR(&msgs[rc - 1].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SO_RXQ_OVFL)
+				memcpy(&udp_ctx->drops, CMSG_DATA(cmsg),
+					sizeof(udp_ctx->drops));
+		}
+	}
+#else
+	/* no recvmmsg, drain what is queued one datagram at a time */
+	for (i = 0; i < n; i++) {
+		int len = recv(sock, iov[i].iov_base, iov[i].iov_len, MSG_DONTWAIT);
+		if (len < 0)
+			break;
+		lens[i] = len;
+	}
+	if (i == 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	rc = i;
+#endif
 
-	return 0;
+	return rc;
 }
-
@@ -1,13 +1,20 @@
 #ifndef _UDP_H_
 #define _UDP_H_
 
+#include <stdint.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+
+
+/* max datagrams taken by one udp_read_batch() call */
+#define UDP_BATCH_MAX		32
 
 
 struct udp_context {
 	int sock;
 	short port;
+	uint32_t drops;		/* kernel receive queue drops so far */
 
 	struct sockaddr_in m_addr;
 	struct ip_mreq m_imr;
@@ -15,7 +22,8 @@ struct udp_context {
 
 struct udp_context * udp_open(char *ip, short port);
 void udp_close(struct udp_context *ctx);
-int udp_read_data(struct udp_context *udp_ctx, void *buf, int size);
+int udp_read_batch(struct udp_context *udp_ctx, struct iovec *iov,
+		int *lens, int n);
 
 
 #endif /* _UDP_H_ */
@@ -12,7 +12,7 @@ static const char *standard_reply = "HTTP/1.1 200 OK\r\n"
 void stati_handler(struct mg_connection *conn,
                    const struct mg_request_info *ri, void *data)
 {
-    mg_printf(conn, "%s", standard_reply);
+    mg_out_printf(conn, "%s", standard_reply);
     const char *s =
 "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
 "<!DOCTYPE svg>"
@@ -24,6 +24,6 @@ void stati_handler(struct mg_connection *conn,
     "<rect x=\"100\" y=\"100\" width=\"100\" height=\"100\" style=\"fill:#00ff00\" />"
   "</g>"
 "</svg>";
-    mg_printf(conn, "%s", s);
+    mg_out_printf(conn, "%s", s);
 }
 
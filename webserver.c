@@ -2,14 +2,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "mongoose.h"
+#include "ingest.h"
+#include "egress.h"
+#include "ts.h"
+#include "stream.h"
+#include "stats_shm.h"
 #include "rtvd.h"
+#include "message.h"
 
 
 static const char *standard_reply = "HTTP/1.1 200 OK\r\n"
 "Conntent-Type: text/html\r\n"
 "Connection: close\r\n\r\n";
 static struct mg_context *ctx;
+static msgobj mo = {
+	MSG_INFO,
+	1,
+	"rtvd",
+};
 
 
 extern void stati_handler(struct mg_connection *conn,
@@ -22,6 +34,10 @@ extern void stream_static_handler(struct mg_connection *conn,
                    const struct mg_request_info *ri, void *data);
 extern void stream_pcr_handler(struct mg_connection *conn,
                    const struct mg_request_info *ri, void *data);
+extern void stream_api_handler(struct mg_connection *conn,
+                   const struct mg_request_info *ri, void *data);
+extern void stream_metrics_handler(struct mg_connection *conn,
+                   const struct mg_request_info *ri, void *data);
 extern void stream_start_flow_handler(struct mg_connection *conn,
                    const struct mg_request_info *ri, void *data);
 extern void stream_stop_flow_handler(struct mg_connection *conn,
@@ -33,8 +49,8 @@ test_error(struct mg_connection *conn, const struct mg_request_info *ri,
 {
     const char *value;
 
-    mg_printf(conn, "%s", standard_reply);
-    mg_printf(conn, "Error: [%d]", ri->status_code);
+    mg_out_printf(conn, "%s", standard_reply);
+    mg_out_printf(conn, "Error: [%d]", ri->status_code);
 }
 
 
@@ -58,7 +74,6 @@ show_index(struct mg_connection *conn,
 	value = mg_get_var(conn, "name1");
 	if (value != NULL) {
 		* (int *) user_data = atoi(value);
-		free(value);
 
 		/*
 		 * Suggested by Luke Dunstan. When POST is used,
@@ -68,39 +83,39 @@ show_index(struct mg_connection *conn,
 		 * Refresh or Back commands in the browser.
 		 */
 		if (!strcmp(request_info->request_method, "POST")) {
-			(void) mg_printf(conn, "HTTP/1.1 303 See Other\r\n"
+			(void) mg_out_printf(conn, "HTTP/1.1 303 See Other\r\n"
 				"Location: %s\r\n\r\n", request_info->uri);
 			return;
 		}
 	}
 
-	mg_printf(conn, "%s",
+	mg_out_printf(conn, "%s",
 		"HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n"
 		"<html><body><h1>Welcome to embedded example of Mongoose");
 #if 0
 
-	mg_printf(conn, " v. %s </h1><ul>", mg_version());
+	mg_out_printf(conn, " v. %s </h1><ul>", mg_version());
 
-	mg_printf(conn, "<li><code>REQUEST_METHOD: %s "
+	mg_out_printf(conn, "<li><code>REQUEST_METHOD: %s "
 	    "REQUEST_URI: \"%s\" QUERY_STRING: \"%s\""
 	    " REMOTE_ADDR: %lx REMOTE_USER: \"(null)\"</code><hr>",
 	    request_info->request_method, request_info->uri,
 	    request_info->query_string ? request_info->query_string : "(null)",
 	    request_info->remote_ip);
-	mg_printf(conn, "<li>Internal int variable value: <b>%d</b>",
+	mg_out_printf(conn, "<li>Internal int variable value: <b>%d</b>",
 			* (int *) user_data);
 
-	mg_printf(conn, "%s",
+	mg_out_printf(conn, "%s",
 		"<form method=\"GET\">Enter new value: "
 		"<input type=\"text\" name=\"name1\"/>"
 		"<input type=\"submit\" value=\"set new value using GET method\"></form>");
-	mg_printf(conn, "%s",
+	mg_out_printf(conn, "%s",
 		"<form method=\"POST\">Enter new value: "
 		"<input type=\"text\" name=\"name1\"/>"
 		"<input type=\"submit\" "
 		"value=\"set new value using POST method\"></form>");
 		
-		mg_printf(conn, "%s",
+		mg_out_printf(conn, "%s",
 		"<li><a href=\"/Makefile\">Regular file (Makefile)</a><hr>"
 		"<li><a href=\"/ssi_test.shtml\">SSI file "
 			"(ssi_test.shtml)</a><hr>"
@@ -108,16 +123,16 @@ show_index(struct mg_connection *conn,
 		"<li><a href=\"/not-existent/\">Custom 404 handler</a><hr>");
 
 	host = mg_get_header(conn, "Host");
-	mg_printf(conn, "<li>'Host' header value: [%s]<hr>",
+	mg_out_printf(conn, "<li>'Host' header value: [%s]<hr>",
 	    host ? host : "NOT SET");
 #endif
 
-	mg_printf(conn, "<li>Upload file example. "
+	mg_out_printf(conn, "<li>Upload file example. "
 	    "<form method=\"post\" enctype=\"multipart/form-data\" "
 	    "action=\"/post\"><input type=\"file\" name=\"file\">"
 	    "<input type=\"submit\"></form>");
 
-	mg_printf(conn, "%s", "</body></html>");
+	mg_out_printf(conn, "%s", "</body></html>");
 }
 
 /*
@@ -134,40 +149,118 @@ show_post(struct mg_connection *conn,
 		const struct mg_request_info *request_info,
 		void *user_data)
 {
-    printf("post start\n");
+    trace_dbg("post start");
 	const char	*path = "ipq.tar.gz";
 	FILE		*fp;
 
-	mg_printf(conn, "HTTP/1.0 200 OK\nContent-Type: text/plain\n\n");
+	mg_out_printf(conn, "HTTP/1.0 200 OK\nContent-Type: text/plain\n\n");
 
 	/*
 	 * Open a file and write POST data into it. We do not do any URL
 	 * decoding here. File will contain form-urlencoded stuff.
 	 */
 	if ((fp = fopen(path, "wb+")) == NULL) {
-		(void) fprintf(stderr, "Error opening %s: %s\n",
-		    path, strerror(errno));
+		trace_err("Error opening %s: %s", path, strerror(errno));
 	} else if (fwrite(request_info->post_data,
 	    request_info->post_data_len, 1, fp) != 1) {
-		(void) fprintf(stderr, "Error writing to %s: %s\n",
-		    path, strerror(errno));
+		trace_err("Error writing to %s: %s", path, strerror(errno));
 	} else {
 		/* Write was successful */
 		(void) fclose(fp);
 	}
-    printf("post end\n");
+    trace_dbg("post end");
 }
 
 //#########################################################################//
 
+static void usage(const char *prog)
+{
+    printf("usage: %s [-t ingest_threads] [-e egress_threads] [-s stall_ms] [-l listeners]\n"
+           "          [-c channels] [-n clients] [-m stats_file] [port]\n", prog);
+    printf("  -t  ingest reactor threads, default one per cpu\n");
+    printf("  -e  egress worker threads, default one per cpu\n");
+    printf("  -s  input stall threshold before null stuffing, default %d ms\n",
+        UDP_STALL_MS);
+    printf("  -l  SO_REUSEPORT http listeners, each with its own workers,\n"
+           "      0 for one per cpu, default 1\n");
+    printf("  -c  udp programs at most, default %d\n", UDP_PROGRAM_LIMIT);
+    printf("  -n  http clients per udp program at most, default %d\n",
+        HTTP_STREAM_LIMIT);
+    printf("  -m  persistent statistics segment, default %s, - for none\n",
+        STATS_SHM_PATH);
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
-    printf("rtvd %s\n", RTVD_VERSION);
+    trace_info("rtvd %s", RTVD_VERSION);
 
     char *port = "8080";
+    int ingest_threads = 0;
+    int egress_threads = 0;
+    int stall_ms = UDP_STALL_MS;
+    char *listeners = NULL;
+    char *stats_file = STATS_SHM_PATH;
+    int max_programs = UDP_PROGRAM_LIMIT;
+    int max_streams = HTTP_STREAM_LIMIT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:e:s:l:c:n:m:h")) != -1) {
+        switch (opt) {
+        case 't':
+            ingest_threads = atoi(optarg);
+            break;
+        case 'e':
+            egress_threads = atoi(optarg);
+            break;
+        case 'l':
+            listeners = optarg;
+            break;
+        case 'c':
+            max_programs = atoi(optarg);
+            if (max_programs <= 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            max_streams = atoi(optarg);
+            if (max_streams <= 0)
+                usage(argv[0]);
+            break;
+        case 'm':
+            stats_file = optarg;
+            break;
+        case 's':
+            stall_ms = atoi(optarg);
+            if (stall_ms <= 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+        port = argv[optind];
+
+    ts_init();
+    if (stream_set_limits(max_programs, max_streams)) {
+        trace_err("cannot allocate the channel registry");
+        return 1;
+    }
+    stream_set_stall_threshold(stall_ms);
+    /* tick often enough to notice a stall within half the threshold */
+    ingest_set_tick(stall_ms / 2);
+    /* history carries over from the last run, rtvd runs on without */
+    if (strcmp(stats_file, "-"))
+        stats_shm_open(stats_file, max_programs);
 
-    if (argc > 1)
-        port = argv[1];
+    if (egress_init(egress_threads)) {
+        trace_err("cannot start egress workers");
+        return 1;
+    }
+    if (ingest_init(ingest_threads)) {
+        trace_err("cannot start ingest reactors");
+        return 1;
+    }
 
     char *webPath   = malloc(128);
     strcpy(webPath,"./"); 
@@ -177,6 +270,8 @@ int main(int argc, char **argv)
     mg_set_option(ctx, "root", webPath);
    // }
     mg_set_option(ctx, "ports", port);
+    if (listeners)
+        mg_set_option(ctx, "listener_shards", listeners);
     //Test_InPutTs();
     mg_bind_to_uri(ctx, "/test", &show_post, "7");
     mg_bind_to_uri(ctx, "/stati", &stati_handler, "8");
@@ -186,10 +281,12 @@ int main(int argc, char **argv)
     mg_bind_to_uri(ctx, "/pcr", &stream_pcr_handler, "12");
     mg_bind_to_uri(ctx, "/ajax/start_flow", &stream_start_flow_handler, "13");
     mg_bind_to_uri(ctx, "/ajax/stop_flow", &stream_stop_flow_handler, "14");
+    mg_bind_to_uri(ctx, "/api/stats", &stream_api_handler, "15");
+    mg_bind_to_uri(ctx, "/metrics", &stream_metrics_handler, "16");
 
     mg_bind_to_error_code(ctx, 404, &test_error, NULL);
     ctx = mg_start();
-    printf("Mongoose %s started on port(s) [%s], serving directory [%s]\n",
+    trace_info("Mongoose %s started on port(s) [%s], serving directory [%s]",
             mg_version(),
             mg_get_option(ctx, "listening_ports"),
             mg_get_option(ctx, "root"));